@@ -5,14 +5,99 @@ Recommended compilation (for local use):
 gcc -Wall -Wextra -DDEBUG c_linux_pthread.c -o my_proxy -lpthread
 
 List of possible defines:
-DEBUG - show error and info messages (perror, printf and fprintf to stderr)
+DEBUG - default log level is debug instead of warning (-v option sets it at runtime)
 DAEMON - server will start as background process (for more info check daemonize function below)
 BUFFER_SIZE=N - set size of pipe buffers to N bytes (default 4096)
+LOG_RING_SIZE=N - log records buffered per thread, more are dropped and counted (default 64)
+LOG_TEXT_SIZE=N - bytes of string argument kept in a log record (default 64)
+LOG_FLUSH_MS=N - how often the log thread looks for new records (default 100)
+
+Listen options: positional ip port (IPv4 or IPv6) and any number of -L ipv4:port, -L [ipv6]:port or
+-L unix:/path (same host clients skip TCP), each optionally with @backlog; -q sets the default backlog.
+MAX_LISTENERS=N (default 16), LISTEN_BACKLOG=N (default 128)
+DEFER_ACCEPT_S=N - TCP_DEFER_ACCEPT of listeners, connections are accepted when the request arrives (default 10, 0 - off)
+ACCEPT_BATCH=N - connections accepted per wakeup and queued to handshake threads at once (default 64)
+REQUEST_TIMEOUT_MS=N - time a connected client has to send its whole request (default 10000)
+HTTP_REQUEST_MAX=N - biggest request line with headers in bytes (default 8192)
+HANDSHAKE_IDLE_MS=N - idle handshake threads exit after this time (default 2000)
+
+Log options: -v error|warning|info|debug, -l stderr (default), syslog, file:path (append)
+or ring:path:bytes (path is moved to path.1 when it reaches bytes, for tmpfs)
+SNI_CHUNK_SIZE=N - SNI bytes per TLS record for the strongest fragmentation strategy (default 2)
+ADAPTIVE_FRAGMENT - learn the cheapest working fragmentation strategy per host (none, tcp segment split, record split, SNI chunks)
+    -s file option saves learned strategies to file and loads them on startup
+    STRATEGY_CACHE_SIZE=N (default 1024 hosts), STRATEGY_TTL=N (seconds, default 7 days),
+    STRATEGY_PROBE_AFTER=N (successful handshakes before a cheaper strategy is tried, default 4),
+    STRATEGY_SAVE_INTERVAL=N (seconds, default 60), HANDSHAKE_TIMEOUT_MS=N (default 5000)
+WARM_CACHE - -w file option keeps resolved addresses (WARM_DNS_TTL seconds, default 300), connect times and
+    ADAPTIVE_FRAGMENT strategies of hosts in a memory mapped file updated in place, so restarts start warm.
+    Fixed size: WARM_CACHE_SLOTS=N hosts (default 256, 368 bytes each), checksummed records
+HELLO_CAPTURE - -c file option appends every ClientHello fragment_data reads to a corpus file
+    (4 byte big endian length + bytes), -a replaces client random, session id and server name letters
+    hello_bench.c replays such corpus through the fragmentation code: make bench
+FAIR_SCHEDULER - deficit round robin between tunnels with token bucket shaping, tunnels that moved less than
+    PRIORITY_BYTES (default 65536) in both directions together are served first
+    -b down_kbit[:up_kbit] option limits total rate per direction (needed for fairness under saturation),
+    -t kbit limits every tunnel, -i kbit limits all tunnels of one client address
+    SCHED_QUANTUM=N (DRR quantum in bytes, default 1500), SCHED_BURST_MS=N (bucket depth, default 20),
+    SCHED_MAX_IPS=N (client addresses tracked for -i, default 256)
+SOCKET_PROFILES - TCP options per tunnel: TCP_NODELAY on both legs during handshake, then every
+    PROFILE_WINDOW_MS (default 1000) the tunnel is reclassified as bulk (a direction faster than
+    PROFILE_BULK_RATE bytes/s, default 262144: Nagle, SO_SNDBUF=PROFILE_BULK_SNDBUF (default 1048576),
+    PROFILE_BULK_CC congestion control (default "bbr")) or interactive (TCP_NODELAY,
+    TCP_NOTSENT_LOWAT=PROFILE_LOWAT (default 16384), TCP_QUICKACK re-armed every window; default congestion
+    control and send buffer size again after bulk)
+UDP_RELAY - SOCKS5 (CONNECT and UDP ASSOCIATE, no authentication) on the same port, so QUIC can use the
+    proxy too. Datagrams are moved with recvmmsg/sendmmsg in batches of UDP_BATCH (default 32), same size
+    ones as a single UDP GSO send, upstream sockets use GRO. Every destination of an association gets its
+    own upstream socket, at most UDP_MAX_FLOWS (default 64, least recently used is replaced), closed after
+    UDP_FLOW_IDLE_MS (default 60000) without traffic. Domain destinations are resolved by a helper thread,
+    datagrams to a name are dropped until it resolves; results and failures are kept UDP_NAME_TTL_MS
+    (default 30000).
+    -Q option reorders CRYPTO frames of QUIC Initial packets to port 443 so that the ClientHello is split
+    inside SNI (the Initial is decrypted and encrypted again with its public keys, size is not changed)
+    (CRYPTO frames of one Initial may come in any number and order, a ClientHello continued in the next Initial is sent as is)
+SOURCE_LIMITS - per client address limits checked at accept time, over limit connections are closed at once
+    -m N - open connections per address, -r N - new connections per second per address (burst N)
+    SOURCE_TABLE_SIZE=N (addresses tracked, power of two, default 1024), SOURCE_PROBE=N (slots searched
+    for an address or for the least recently seen one to replace, default 8)
+METRICS - GET /metrics on the proxy port answers with counters in Prometheus text format
+    (accepted connections, open tunnels, per address counters of SOURCE_LIMITS, CIDR_RULES hits,
+    mux links and streams)
+MUX_LINK - split deployment: -U host:port sends CONNECT tunnels as streams over MUX_LINKS (default 2)
+    long-lived connections to a peer proxy built with MUX_LINK, which connects and fragments for them
+    (any MUX_LINK build accepts links on its normal port). Per stream flow control, every direction
+    buffers at most MUX_WINDOW bytes (default 65536, at least 16384). The client gets 200 before the
+    peer has connected; SOCKS5 CONNECT is still dialed locally; HOT_UPGRADE closes the streams
+CIDR_RULES - -R file option: lines "fragment|bypass|deny address[/length]" (IPv4 or IPv6, # comments), the
+    longest prefix containing the address a tunnel connects to decides: deny - not dialed, bypass - not
+    fragmented, fragment - fragmented on any port; other addresses as before. Works for IP literals and
+    SOCKS5. Lookups use a compressed trie (poptrie), hundreds of thousands of prefixes are fine
+PAC_SERVER - -p file option (blacklist.txt, a domain per line) makes GET /proxy.pac and /wpad.dat on the
+    proxy port answer with a proxy auto-config script: listed domains and their subdomains go through the
+    proxy, everything else direct (suffix lookup in a hash). Compiled again when the file changes
+CIRCUIT_BREAKER - upstream connects time out after CONNECT_TIMEOUT_MS per address (default 5000) and a failed
+    CONNECT is answered with 504 (timeout) or 502. BREAKER_FAILURES (default 5) failures of a host:port, each
+    within BREAKER_WINDOW_MS (default 30000) of the previous, make its connects fail at once for
+    BREAKER_OPEN_MS (default 1000), then one trial connect decides; every failed trial doubles the time up
+    to BREAKER_MAX_OPEN_MS (default 60000). BREAKER_SLOTS=N failing destinations tracked (default 256),
+    BREAKER_PROBE=N slots searched (default 8). With METRICS: state, failures and fast fails per destination
+CPU_LOCAL - tunnels stay on the core that receives their packets: -C moves the handshake thread to the
+    SO_INCOMING_CPU of the client before it connects upstream, relay threads inherit that core;
+    -P makes every TCP listener one SO_REUSEPORT socket per core (count it in MAX_LISTENERS) with a BPF
+    program that picks the socket of the receiving core, each accepted by a thread on that core.
+    With METRICS: tunnels and cross-core handoffs (handshake started on another core) per core
+HOT_UPGRADE - kill -USR2 pid execs the binary again (same path and arguments) and hands the listening socket
+    and all open tunnels over to it, then the old process exits; a build with another BUFFER_SIZE or other feature
+    defines (all of the above except DEBUG and DAEMON, numeric tunables are not compared) refuses the handoff
+    and the old process keeps running. UPGRADE_WAIT_MS=N - time for handshakes in progress to finish (default 3000)
 
 Compilation with all defines (just as an example):
-gcc -Wall -Wextra -DDEBUG -DDAEMON -DBUFFER_SIZE=1024 c_linux_pthread.c -o my_proxy -lpthread
+gcc -Wall -Wextra -DDEBUG -DDAEMON -DBUFFER_SIZE=1024 -DADAPTIVE_FRAGMENT -DWARM_CACHE -DCIDR_RULES -DPAC_SERVER -DCIRCUIT_BREAKER -DFAIR_SCHEDULER -DSOCKET_PROFILES -DUDP_RELAY -DSOURCE_LIMITS -DMETRICS -DMUX_LINK -DCPU_LOCAL -DHOT_UPGRADE c_linux_pthread.c -o my_proxy -lpthread
 */
 
+#define _GNU_SOURCE /* accept4, recvmmsg, sendmmsg */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,50 +115,508 @@ gcc -Wall -Wextra -DDEBUG -DDAEMON -DBUFFER_SIZE=1024 c_linux_pthread.c -o my_pr
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <poll.h>
+#include <ctype.h>
+#include <limits.h>
+#include <strings.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <sys/un.h>
+#ifdef UDP_RELAY
+#include <netinet/udp.h>
+#endif
+#ifdef WARM_CACHE
+#include <sys/mman.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef CPU_LOCAL
+#include <sched.h>
+#include <linux/filter.h>
+#endif
 
 #ifndef BUFFER_SIZE
 #define BUFFER_SIZE 4096
 #endif
 
+#ifndef MAX_LISTENERS
+#define MAX_LISTENERS 16
+#endif
+
+#ifndef LISTEN_BACKLOG
+#define LISTEN_BACKLOG 128
+#endif
+
+#ifndef ACCEPT_BATCH
+#define ACCEPT_BATCH 64
+#endif
+
+#ifndef DEFER_ACCEPT_S
+#define DEFER_ACCEPT_S 10
+#endif
+
+#ifndef REQUEST_TIMEOUT_MS
+#define REQUEST_TIMEOUT_MS 10000
+#endif
+
+#ifndef HTTP_REQUEST_MAX
+#define HTTP_REQUEST_MAX 8192
+#endif
+
+#ifndef HANDSHAKE_IDLE_MS
+#define HANDSHAKE_IDLE_MS 2000
+#endif
+
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 64
+#endif
+
+#ifndef LOG_TEXT_SIZE
+#define LOG_TEXT_SIZE 64
+#endif
+
+#ifndef LOG_FLUSH_MS
+#define LOG_FLUSH_MS 100
+#endif
+
+#ifndef SNI_CHUNK_SIZE
+#define SNI_CHUNK_SIZE 2
+#endif
+#define FRAG_MAX_SEGMENTS (2 + 255 / SNI_CHUNK_SIZE + 1)
+#define FRAG_OUT_SIZE (5 + 2048 + 5 * FRAG_MAX_SEGMENTS)
+
+#ifdef ADAPTIVE_FRAGMENT
+#ifndef STRATEGY_CACHE_SIZE
+#define STRATEGY_CACHE_SIZE 1024
+#endif
+#define STRATEGY_PROBE_LIMIT 8
+#ifndef STRATEGY_TTL
+#define STRATEGY_TTL (7 * 24 * 3600)
+#endif
+#ifndef STRATEGY_PROBE_AFTER
+#define STRATEGY_PROBE_AFTER 4
+#endif
+#ifndef STRATEGY_SAVE_INTERVAL
+#define STRATEGY_SAVE_INTERVAL 60
+#endif
+#ifndef HANDSHAKE_TIMEOUT_MS
+#define HANDSHAKE_TIMEOUT_MS 5000
+#endif
+#endif
+
+#ifdef WARM_CACHE
+#ifndef WARM_CACHE_SLOTS
+#define WARM_CACHE_SLOTS 256
+#endif
+#ifndef WARM_DNS_TTL
+#define WARM_DNS_TTL 300
+#endif
+#endif
+
+#ifdef CIRCUIT_BREAKER
+#ifndef CONNECT_TIMEOUT_MS
+#define CONNECT_TIMEOUT_MS 5000
+#endif
+#ifndef BREAKER_FAILURES
+#define BREAKER_FAILURES 5
+#endif
+#ifndef BREAKER_WINDOW_MS
+#define BREAKER_WINDOW_MS 30000
+#endif
+#ifndef BREAKER_OPEN_MS
+#define BREAKER_OPEN_MS 1000
+#endif
+#ifndef BREAKER_MAX_OPEN_MS
+#define BREAKER_MAX_OPEN_MS 60000
+#endif
+#ifndef BREAKER_SLOTS
+#define BREAKER_SLOTS 256
+#endif
+#ifndef BREAKER_PROBE
+#define BREAKER_PROBE 8
+#endif
+#endif
+
+#ifdef CPU_LOCAL
+#ifndef CPU_LOCAL_MAX
+#define CPU_LOCAL_MAX 64
+#endif
+#endif
+
+#ifdef HOT_UPGRADE
+#ifndef UPGRADE_WAIT_MS
+#define UPGRADE_WAIT_MS 3000
+#endif
+#endif
+
+#ifdef SOCKET_PROFILES
+#ifndef PROFILE_WINDOW_MS
+#define PROFILE_WINDOW_MS 1000
+#endif
+#ifndef PROFILE_BULK_RATE
+#define PROFILE_BULK_RATE 262144
+#endif
+#ifndef PROFILE_BULK_SNDBUF
+#define PROFILE_BULK_SNDBUF 1048576
+#endif
+#ifndef PROFILE_BULK_CC
+#define PROFILE_BULK_CC "bbr"
+#endif
+#ifndef PROFILE_LOWAT
+#define PROFILE_LOWAT 16384
+#endif
+#endif
+
+#ifdef UDP_RELAY
+#ifndef UDP_BATCH
+#define UDP_BATCH 32
+#endif
+#ifndef UDP_MAX_FLOWS
+#define UDP_MAX_FLOWS 64
+#endif
+#ifndef UDP_FLOW_IDLE_MS
+#define UDP_FLOW_IDLE_MS 60000
+#endif
+#ifndef UDP_NAME_TTL_MS
+#define UDP_NAME_TTL_MS 30000
+#endif
+#define UDP_SLOT 2048 /* biggest datagram with SOCKS5 header */
+#endif
+
+#ifdef SOURCE_LIMITS
+#ifndef SOURCE_TABLE_SIZE
+#define SOURCE_TABLE_SIZE 1024 /* power of two */
+#endif
+#ifndef SOURCE_PROBE
+#define SOURCE_PROBE 8
+#endif
+#endif
+
+#ifdef MUX_LINK
+#ifndef MUX_LINKS
+#define MUX_LINKS 2
+#endif
+#ifndef MUX_WINDOW
+#define MUX_WINDOW 65536
+#endif
+#endif
+
+#ifdef FAIR_SCHEDULER
+#ifndef PRIORITY_BYTES
+#define PRIORITY_BYTES 65536
+#endif
+#ifndef SCHED_QUANTUM
+#define SCHED_QUANTUM 1500
+#endif
+#ifndef SCHED_BURST_MS
+#define SCHED_BURST_MS 20
+#endif
+#ifndef SCHED_MAX_IPS
+#define SCHED_MAX_IPS 256
+#endif
+#endif
+
+/*
+Logger. Threads put fixed size records into their own single producer single
+consumer ring, a background thread formats them and writes to the sink.
+A full ring drops the record (counted) instead of blocking the relay.
+Format strings are printf-like but only know %s (the text argument, copied
+into the record), %d, %u and %x (the two integer arguments, in order).
+*/
+typedef struct {
+    struct timespec ts;
+    const char *fmt;     /* string literal */
+    int64_t args[2];
+    int err;             /* errno to append, 0 - none */
+    int level;
+    char text[LOG_TEXT_SIZE];
+} log_record_t;
+
+typedef struct log_ring {
+    struct log_ring *next;
+    uint32_t head;       /* written by owner thread */
+    uint32_t tail;       /* written by drain thread */
+    int dead;            /* owner thread exited */
+    log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
+enum { LOG_SINK_STDERR = 0, LOG_SINK_SYSLOG, LOG_SINK_FILE, LOG_SINK_RING };
+
+#ifdef DEBUG
+static int log_level = LOG_DEBUG;
+#else
+static int log_level = LOG_WARNING;
+#endif
+static int log_sink = LOG_SINK_STDERR;
+static const char *log_path = NULL;
+static long log_ring_bytes = 0;
+static FILE *log_file = NULL;
+static int log_running = 0;
+static uint32_t log_dropped = 0;
+static int log_queued = 0; /* records in rings not written yet */
+static log_ring_t *log_rings = NULL; /* threads push with CAS, only the drain thread unlinks */
+static pthread_key_t log_key;
+static __thread log_ring_t *log_ring_self = NULL;
+
+#define LOG(level, fmt, text, a, b) do { \
+    if ((level) <= log_level) log_event((level), 0, (fmt), (text), (int64_t)(a), (int64_t)(b)); \
+} while (0)
+#define LOG_ERRNO(level, fmt, text, a, b) do { \
+    if ((level) <= log_level) log_event((level), errno, (fmt), (text), (int64_t)(a), (int64_t)(b)); \
+} while (0)
+
+const char *log_level_name(int level) {
+    switch (level) {
+    case LOG_ERR: return "error";
+    case LOG_WARNING: return "warning";
+    case LOG_INFO: return "info";
+    default: return "debug";
+    }
+}
+
+int log_parse_level(const char *name) {
+    static const int levels[] = {LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG};
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        if (strcmp(name, log_level_name(levels[i])) == 0) return levels[i];
+    }
+    return -1;
+}
+
+/* stderr, syslog, file:path or ring:path:bytes */
+int log_parse_sink(const char *spec) {
+    if (strcmp(spec, "stderr") == 0) {
+        log_sink = LOG_SINK_STDERR;
+    } else if (strcmp(spec, "syslog") == 0) {
+        log_sink = LOG_SINK_SYSLOG;
+    } else if (strncmp(spec, "file:", 5) == 0 && spec[5]) {
+        log_sink = LOG_SINK_FILE;
+        log_path = spec + 5;
+    } else if (strncmp(spec, "ring:", 5) == 0) {
+        char *colon = strrchr(spec + 5, ':');
+        if (!colon || colon == spec + 5) return -1;
+        log_ring_bytes = atol(colon + 1);
+        if (log_ring_bytes <= 0) return -1;
+        char *path = strndup(spec + 5, colon - (spec + 5));
+        if (!path) return -1;
+        log_sink = LOG_SINK_RING;
+        log_path = path;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+size_t log_format(const log_record_t *r, char *line, size_t size) {
+    size_t len = 0;
+    int arg = 0;
+#define LOG_PUT(...) do { \
+    int w = snprintf(line + len, size - len, __VA_ARGS__); \
+    if (w > 0) len = (len + w < size) ? len + w : size - 1; \
+} while (0)
+    for (const char *f = r->fmt; *f && len + 1 < size; f++) {
+        if (*f != '%' || !f[1]) {
+            line[len++] = *f;
+            continue;
+        }
+        f++;
+        int64_t v = arg < 2 ? r->args[arg] : 0;
+        switch (*f) {
+        case 's': LOG_PUT("%s", r->text); break;
+        case 'd': LOG_PUT("%lld", (long long)v); arg++; break;
+        case 'u': LOG_PUT("%llu", (unsigned long long)v); arg++; break;
+        case 'x': LOG_PUT("%llx", (unsigned long long)v); arg++; break;
+        default: line[len++] = *f; break;
+        }
+    }
+    line[len] = 0;
+    if (r->err) LOG_PUT(": %s", strerror(r->err));
+#undef LOG_PUT
+    return len;
+}
+
+void log_emit(const log_record_t *r) {
+    char line[512];
+    log_format(r, line, sizeof(line));
+    if (log_sink == LOG_SINK_SYSLOG) {
+        syslog(r->level, "%s", line);
+        return;
+    }
+    FILE *out = log_file ? log_file : stderr;
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&r->ts.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(out, "%s.%03ld %s %s\n", stamp, r->ts.tv_nsec / 1000000, log_level_name(r->level), line);
+    if (log_sink == LOG_SINK_RING && log_file && ftell(log_file) >= log_ring_bytes) {
+        char old[PATH_MAX];
+        snprintf(old, sizeof(old), "%s.1", log_path);
+        fclose(log_file);
+        rename(log_path, old);
+        log_file = fopen(log_path, "w");
+    }
+}
+
+void log_ring_exit(void *arg) {
+    log_ring_t *r = (log_ring_t *)arg;
+    __atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+log_ring_t *log_ring_get(void) {
+    if (log_ring_self) return log_ring_self;
+    log_ring_t *r = calloc(1, sizeof(log_ring_t));
+    if (!r) return NULL;
+    r->next = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    pthread_setspecific(log_key, r);
+    log_ring_self = r;
+    return r;
+}
+
+void log_event(int level, int err, const char *fmt, const char *text, int64_t a, int64_t b) {
+    log_record_t tmp;
+    log_record_t *rec = &tmp;
+    log_ring_t *r = NULL;
+    uint32_t head = 0;
+    if (log_running) {
+        r = log_ring_get();
+        if (r) {
+            head = r->head;
+            if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) r = NULL;
+        }
+        if (!r) {
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        rec = &r->records[head % LOG_RING_SIZE];
+    }
+    clock_gettime(CLOCK_REALTIME, &rec->ts);
+    rec->fmt = fmt;
+    rec->args[0] = a;
+    rec->args[1] = b;
+    rec->err = err;
+    rec->level = level;
+    snprintf(rec->text, sizeof(rec->text), "%s", text ? text : "");
+    if (r) {
+        __atomic_add_fetch(&log_queued, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    } else {
+        log_emit(rec); /* logger is not started yet, only main thread runs */
+    }
+}
+
+void *log_drain(void *arg) {
+    (void)arg;
+    uint32_t reported = 0;
+    while (1) {
+        int idle = 1;
+        log_ring_t **pp = &log_rings;
+        log_ring_t *r;
+        while ((r = __atomic_load_n(pp, __ATOMIC_ACQUIRE))) {
+            int dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+            uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            while (r->tail != head) {
+                log_emit(&r->records[r->tail % LOG_RING_SIZE]);
+                __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+                __atomic_sub_fetch(&log_queued, 1, __ATOMIC_RELAXED);
+                idle = 0;
+            }
+            if (dead) {
+                /* a new ring may have been pushed over the head meanwhile, then it is freed on a later pass */
+                log_ring_t *expected = r;
+                if (pp != &log_rings) {
+                    *pp = r->next;
+                    free(r);
+                    continue;
+                }
+                if (__atomic_compare_exchange_n(pp, &expected, r->next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    free(r);
+                    continue;
+                }
+            }
+            pp = &r->next;
+        }
+        uint32_t dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if (dropped != reported) {
+            log_record_t rec = {{0, 0}, "log: %u records dropped (ring full)", {dropped - reported, 0}, 0, LOG_WARNING, ""};
+            clock_gettime(CLOCK_REALTIME, &rec.ts);
+            log_emit(&rec);
+            reported = dropped;
+        }
+        if (log_file) fflush(log_file);
+        if (idle) usleep(LOG_FLUSH_MS * 1000);
+    }
+    return NULL;
+}
+
+/* at exit, gives the drain thread a moment to write what is queued (a fatal error logged just before exit) */
+void log_wait(void) {
+    for (int i = 0; i < 100 && __atomic_load_n(&log_queued, __ATOMIC_RELAXED) > 0; i++) usleep(1000);
+    if (log_file) fflush(log_file);
+}
+
+/* called after daemonize, threads don't survive fork */
+void log_start(void) {
+    if (log_sink == LOG_SINK_SYSLOG) {
+        openlog("proxy", LOG_PID, LOG_DAEMON);
+    } else if (log_sink == LOG_SINK_FILE || log_sink == LOG_SINK_RING) {
+        log_file = fopen(log_path, "a");
+        if (!log_file) {
+            LOG_ERRNO(LOG_ERR, "log: can't open %s", log_path, 0, 0);
+        }
+    }
+    pthread_key_create(&log_key, log_ring_exit);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_drain, NULL) != 0) {
+        LOG_ERRNO(LOG_ERR, "log: pthread_create", NULL, 0, 0);
+        return;
+    }
+    pthread_detach(tid);
+    log_running = 1;
+    atexit(log_wait);
+}
+
+/* daemonize changes directory to / */
+const char *absolute_path(const char *path) {
+    char cwd[PATH_MAX];
+    if (path[0] == '/' || !getcwd(cwd, sizeof(cwd))) return path;
+    size_t len = strlen(cwd) + strlen(path) + 2;
+    char *full = malloc(len);
+    if (!full) return path;
+    snprintf(full, len, "%s/%s", cwd, path);
+    return full;
+}
+
 #ifdef DAEMON
 void daemonize(void) {
     pid_t pid;
     pid = fork();
     if (pid < 0) {
-#ifdef DEBUG
-        perror("fork");
-#endif
+        LOG_ERRNO(LOG_ERR, "fork", NULL, 0, 0);
         exit(EXIT_FAILURE);
     }
     if (pid > 0) {
         exit(EXIT_SUCCESS);
     }
     if (setsid() < 0) {
-#ifdef DEBUG
-        perror("setsid");
-#endif
+        LOG_ERRNO(LOG_ERR, "setsid", NULL, 0, 0);
         exit(EXIT_FAILURE);
     }
     pid = fork();
     if (pid < 0) {
-#ifdef DEBUG
-        perror("fork");
-#endif
+        LOG_ERRNO(LOG_ERR, "fork", NULL, 0, 0);
         exit(EXIT_FAILURE);
     }
     if (pid > 0) {
         exit(EXIT_SUCCESS);
     }
     if (setpgid(0, 0) < 0) {
-#ifdef DEBUG
-        perror("setpgid");
-#endif
+        LOG_ERRNO(LOG_ERR, "setpgid", NULL, 0, 0);
         exit(EXIT_FAILURE);
     }
     if (chdir("/") < 0) {
-#ifdef DEBUG
-        perror("chdir");
-#endif
+        LOG_ERRNO(LOG_ERR, "chdir", NULL, 0, 0);
         exit(EXIT_FAILURE);
     }
     umask(0);
@@ -82,9 +625,7 @@ void daemonize(void) {
     close(STDERR_FILENO);
     int fd = open("/dev/null", O_RDWR);
     if (fd < 0) {
-#ifdef DEBUG
-        perror("open");
-#endif
+        LOG_ERRNO(LOG_ERR, "open", NULL, 0, 0);
         exit(EXIT_FAILURE);
     }
     if (dup2(fd, STDIN_FILENO) < 0) exit(EXIT_FAILURE);
@@ -96,284 +637,5020 @@ void daemonize(void) {
 }
 #endif
 
+typedef enum {
+    FRAG_NONE = 0,      /* forward ClientHello as is */
+    FRAG_TCP_SPLIT,     /* one TLS record sent as two TCP segments split inside SNI */
+    FRAG_RECORD_SPLIT,  /* two TLS records split inside SNI */
+    FRAG_SNI_CHUNKS,    /* TLS record per SNI_CHUNK_SIZE bytes of SNI (the strongest one) */
+    FRAG_STRATEGY_COUNT
+} frag_strategy_t;
+
+#define FRAG_STRONGEST (FRAG_STRATEGY_COUNT - 1)
+
+int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define FNV1A_SEED 14695981039346656037ull
+
+/* 64 bit FNV-1a of len bytes, seed is FNV1A_SEED or the hash of what comes before */
+uint64_t fnv1a(const void *data, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < len; i++) seed = (seed ^ p[i]) * 1099511628211ull;
+    return seed;
+}
+
+/* host names are compared with strcasecmp, so they are hashed in lower case */
+uint64_t host_hash(const char *host, uint64_t seed) {
+    uint8_t lower[64];
+    size_t n = 0;
+    for (; *host; host++) {
+        lower[n++] = (uint8_t)tolower((unsigned char)*host);
+        if (n == sizeof(lower)) {
+            seed = fnv1a(lower, n, seed);
+            n = 0;
+        }
+    }
+    return fnv1a(lower, n, seed);
+}
+
+#ifdef FAIR_SCHEDULER
+/*
+Relay scheduler. Every pipe_data thread asks for permission before writing a
+chunk. Each direction of the uplink is a link with optional token bucket (-b),
+waiting flows are served by deficit round robin, flows of tunnels that have not
+moved PRIORITY_BYTES yet (both directions counted together) are served before
+bulk ones. Every flow can also be
+limited by its own bucket (-t) and by a bucket shared per client address (-i).
+There is no scheduler thread: whoever waits runs the dispatch loop.
+*/
+enum { SCHED_UP = 0, SCHED_DOWN = 1 };
+enum { SCHED_PRIO = 0, SCHED_BULK = 1 };
+
 typedef struct {
-    int from_fd;
-    int to_fd;
-} pipe_args_t;
+    int64_t tokens; /* bytes, goes negative after a grant bigger than what was left */
+    int64_t rate;   /* bytes per second, 0 - unlimited */
+    int64_t burst;
+    int64_t updated_ns;
+} bucket_t;
 
-ssize_t read_n(int fd, void *buf, size_t n) {
-    size_t total = 0;
-    while (total < n) {
-        ssize_t r = read(fd, (char*)buf + total, n - total);
-        if (r <= 0) return r;
-        total += r;
+typedef struct {
+    uint8_t addr[16];
+    int refs;
+    bucket_t bucket;
+} sched_ip_t;
+
+typedef struct sched_flow {
+    struct sched_flow *next;
+    struct sched_flow *prev;
+    int link;
+    bucket_t bucket;
+    sched_ip_t *ip;
+    uint64_t *tunnel_bytes; /* shared by both directions of the tunnel, links have separate locks */
+    int64_t deficit;
+    size_t req;
+    int granted;
+    pthread_cond_t cond;
+} sched_flow_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    bucket_t bucket;
+    sched_flow_t active[2]; /* list heads, SCHED_PRIO and SCHED_BULK */
+    int waiting[2];
+    sched_ip_t ips[SCHED_MAX_IPS];
+} sched_link_t;
+
+static sched_link_t sched_links[2];
+static int64_t sched_link_rate[2] = {0, 0};
+static int64_t sched_tunnel_rate = 0;
+static int64_t sched_ip_rate = 0;
+static pthread_condattr_t sched_condattr;
+
+void bucket_init(bucket_t *b, int64_t rate, int64_t now) {
+    b->rate = rate;
+    b->burst = rate * SCHED_BURST_MS / 1000;
+    if (b->burst < 2 * BUFFER_SIZE) b->burst = 2 * BUFFER_SIZE;
+    b->tokens = b->burst;
+    b->updated_ns = now;
+}
+
+void bucket_refill(bucket_t *b, int64_t now) {
+    if (b->rate == 0) return;
+    int64_t elapsed = now - b->updated_ns;
+    if (elapsed >= 1000000000) {
+        b->tokens = b->burst;
+    } else {
+        b->tokens += elapsed * b->rate / 1000000000;
+        if (b->tokens > b->burst) b->tokens = b->burst;
     }
-    return total;
+    b->updated_ns = now;
 }
 
-ssize_t write_n(int fd, const void *buf, size_t n) {
-    size_t total = 0;
-    while (total < n) {
-        ssize_t w = write(fd, (const char*)buf + total, n - total);
-        if (w <= 0) return w;
-        total += w;
+int bucket_ok(const bucket_t *b) {
+    return b->rate == 0 || b->tokens > 0;
+}
+
+void bucket_take(bucket_t *b, size_t n) {
+    if (b->rate) b->tokens -= (int64_t)n;
+}
+
+/* nanoseconds until the bucket is positive again */
+int64_t bucket_wait_ns(const bucket_t *b) {
+    if (bucket_ok(b)) return 0;
+    return (1 - b->tokens) * 1000000000 / b->rate;
+}
+
+void sched_list_remove(sched_flow_t *f) {
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+}
+
+void sched_list_append(sched_flow_t *head, sched_flow_t *f) {
+    f->prev = head->prev;
+    f->next = head;
+    head->prev->next = f;
+    head->prev = f;
+}
+
+void sched_init(void) {
+    int64_t now = now_ns();
+    pthread_condattr_init(&sched_condattr);
+    pthread_condattr_setclock(&sched_condattr, CLOCK_MONOTONIC);
+    for (int l = 0; l < 2; l++) {
+        sched_link_t *link = &sched_links[l];
+        memset(link, 0, sizeof(*link));
+        pthread_mutex_init(&link->lock, NULL);
+        bucket_init(&link->bucket, sched_link_rate[l], now);
+        for (int c = 0; c < 2; c++) {
+            link->active[c].next = link->active[c].prev = &link->active[c];
+        }
     }
-    return total;
 }
 
-void *pipe_data(void *arg) {
-    pipe_args_t *p = (pipe_args_t *)arg;
-    char buffer[BUFFER_SIZE];
-    ssize_t n;
-    while ((n = read(p->from_fd, buffer, sizeof(buffer))) > 0) {
-        ssize_t sent = 0;
-        while (sent < n) {
-            ssize_t w = write(p->to_fd, buffer + sent, n - sent);
-            if (w <= 0) {
-                if (w < 0) {
-                    if (errno == EPIPE || errno == ECONNRESET) {
-                        goto cleanup;
-                    }
-#ifdef DEBUG
-                    perror("write");
-#endif
-                }
-                goto cleanup;
-            }
-            sent += w;
+int sched_enabled(void) {
+    return sched_link_rate[SCHED_UP] || sched_link_rate[SCHED_DOWN] || sched_tunnel_rate || sched_ip_rate;
+}
+
+/* caller holds link->lock */
+sched_ip_t *sched_ip_get(sched_link_t *link, const struct sockaddr_storage *addr) {
+    uint8_t key[16] = {0};
+    if (addr->ss_family == AF_INET) {
+        memcpy(key, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+    } else if (addr->ss_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    } else {
+        return NULL;
+    }
+    uint64_t h = fnv1a(key, 16, FNV1A_SEED);
+    sched_ip_t *free_slot = NULL;
+    for (int i = 0; i < SCHED_MAX_IPS; i++) {
+        sched_ip_t *ip = &link->ips[(h + i) % SCHED_MAX_IPS];
+        if (ip->refs > 0 && memcmp(ip->addr, key, 16) == 0) {
+            ip->refs++;
+            return ip;
         }
+        if (ip->refs == 0 && !free_slot) free_slot = ip;
     }
-#ifdef DEBUG
-    if (n < 0) {
-        perror("read");
+    if (!free_slot) return NULL;
+    memcpy(free_slot->addr, key, 16);
+    free_slot->refs = 1;
+    bucket_init(&free_slot->bucket, sched_ip_rate, now_ns());
+    return free_slot;
+}
+
+void sched_flow_init(sched_flow_t *f, int link_id, const struct sockaddr_storage *addr, uint64_t *tunnel_bytes) {
+    sched_link_t *link = &sched_links[link_id];
+    memset(f, 0, sizeof(*f));
+    f->link = link_id;
+    f->tunnel_bytes = tunnel_bytes;
+    bucket_init(&f->bucket, sched_tunnel_rate, now_ns());
+    pthread_cond_init(&f->cond, &sched_condattr);
+    if (sched_ip_rate) {
+        pthread_mutex_lock(&link->lock);
+        f->ip = sched_ip_get(link, addr);
+        pthread_mutex_unlock(&link->lock);
     }
-#endif
-cleanup:
-    shutdown(p->to_fd, SHUT_WR);
-    shutdown(p->from_fd, SHUT_RD);
-    free(p);
-    return NULL;
 }
 
-int fragment_data(int local_fd, int remote_fd) {
-    uint8_t head[5];
-    ssize_t n = read_n(local_fd, head, 5);
-    if (n != 5) return -1;
-    uint8_t data[2048];
-    n = read(local_fd, data, sizeof(data));
-    if (n <= 0) return -1;
-    size_t data_len = (size_t)n;
-    size_t sni_start = 0;
-    size_t sni_end = 0;
-    int found_sni = 0;
-    for (size_t i = 0; i < data_len - 8; i++) {
-        if (data[i + 0] == 0x00 && data[i + 1] == 0x00 && data[i + 2] == 0x00 && data[i + 4] == 0x00 && data[i + 6] == 0x00 && data[i + 7] == 0x00) {
-            uint8_t ext_len = data[i + 3];
-            uint8_t server_name_list_len = data[i + 5];
-            uint8_t server_name_len = data[i + 8];
-            if ((int)ext_len - (int)server_name_list_len == 2 && 
-                (int)server_name_list_len - (int)server_name_len == 3) {
-                found_sni = 1;
-                sni_start = i + 9;
-                sni_end = sni_start + server_name_len;
-                break;
+void sched_flow_destroy(sched_flow_t *f) {
+    sched_link_t *link = &sched_links[f->link];
+    if (f->ip) {
+        pthread_mutex_lock(&link->lock);
+        f->ip->refs--;
+        pthread_mutex_unlock(&link->lock);
+    }
+    pthread_cond_destroy(&f->cond);
+}
+
+/* caller holds link->lock */
+void sched_dispatch(sched_link_t *link, int64_t now) {
+    bucket_refill(&link->bucket, now);
+    for (int c = 0; c < 2; c++) {
+        sched_flow_t *head = &link->active[c];
+        int idle = 0;
+        while (link->waiting[c] > 0 && idle < link->waiting[c] && bucket_ok(&link->bucket)) {
+            sched_flow_t *f = head->next;
+            sched_list_remove(f);
+            bucket_refill(&f->bucket, now);
+            if (f->ip) bucket_refill(&f->ip->bucket, now);
+            if (!bucket_ok(&f->bucket) || (f->ip && !bucket_ok(&f->ip->bucket))) {
+                sched_list_append(head, f);
+                idle++;
+                continue;
             }
+            idle = 0;
+            f->deficit += SCHED_QUANTUM;
+            if (f->deficit < (int64_t)f->req) {
+                sched_list_append(head, f);
+                continue;
+            }
+            f->deficit -= (int64_t)f->req;
+            bucket_take(&link->bucket, f->req);
+            bucket_take(&f->bucket, f->req);
+            if (f->ip) bucket_take(&f->ip->bucket, f->req);
+            link->waiting[c]--;
+            f->granted = 1;
+            pthread_cond_signal(&f->cond);
         }
     }
-    if (!found_sni) {
-        return -1;
-    }
-    uint8_t part_buf[3 + 2 + 2048];
-    part_buf[0] = 0x16;
-    part_buf[1] = 0x03;
-    part_buf[2] = 0x04;
-    size_t part_start_len = sni_start;
-    if (part_start_len > 0) {
-        uint16_t len_be = htons((uint16_t)part_start_len);
-        memcpy(part_buf + 3, &len_be, 2);
-        memcpy(part_buf + 5, data, part_start_len);
-        if (write_n(remote_fd, part_buf, 5 + part_start_len) < 0) return -1;
-    }
-    for (size_t i = sni_start; i < sni_end; i += 2) {
-        size_t chunk_len = (sni_end - i >= 2) ? 2 : (sni_end - i);
-        uint16_t len_be = htons((uint16_t)chunk_len);
-        memcpy(part_buf + 3, &len_be, 2);
-        memcpy(part_buf + 5, data + i, chunk_len);
-        if (write_n(remote_fd, part_buf, 5 + chunk_len) < 0) return -1;
-    }
-    size_t part_end_len = data_len - sni_end;
-    if (part_end_len > 0) {
-        uint16_t len_be = htons((uint16_t)part_end_len);
-        memcpy(part_buf + 3, &len_be, 2);
-        memcpy(part_buf + 5, data + sni_end, part_end_len);
-        if (write_n(remote_fd, part_buf, 5 + part_end_len) < 0) return -1;
+}
+
+void sched_acquire(sched_flow_t *f, size_t n) {
+    if (!sched_enabled()) return;
+    sched_link_t *link = &sched_links[f->link];
+    int c = __atomic_load_n(f->tunnel_bytes, __ATOMIC_RELAXED) < PRIORITY_BYTES ? SCHED_PRIO : SCHED_BULK;
+    pthread_mutex_lock(&link->lock);
+    f->req = n;
+    f->granted = 0;
+    sched_list_append(&link->active[c], f);
+    link->waiting[c]++;
+    while (1) {
+        int64_t now = now_ns();
+        sched_dispatch(link, now);
+        if (f->granted) break;
+        int64_t wait = bucket_wait_ns(&link->bucket);
+        if (bucket_wait_ns(&f->bucket) > wait) wait = bucket_wait_ns(&f->bucket);
+        if (f->ip && bucket_wait_ns(&f->ip->bucket) > wait) wait = bucket_wait_ns(&f->ip->bucket);
+        if (wait < 1000000) wait = 1000000;
+        if (wait > 100000000) wait = 100000000;
+        now += wait;
+        struct timespec deadline = {now / 1000000000, now % 1000000000};
+        pthread_cond_timedwait(&f->cond, &link->lock, &deadline);
+        if (f->granted) break;
     }
-    return 0;
+    pthread_mutex_unlock(&link->lock);
+    __atomic_add_fetch(f->tunnel_bytes, n, __ATOMIC_RELAXED);
 }
 
-int connect_remote(const char *host, const char *port) {
-    struct addrinfo hints = {0}, *res, *rp;
-    int sock = -1;
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    int err = getaddrinfo(host, port, &hints, &res);
+int64_t parse_kbit(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || v < 0) return -1;
+    return v * 1000 / 8;
+}
+#endif
+
+#ifdef SOURCE_LIMITS
+/*
+Per source address limits, checked by the accept thread before a client is
+queued: -m open connections, -r new connections per second (token bucket,
+burst is the rate rounded up to one). Sources live in a fixed open addressing
+table without locks, so per-core accept threads of CPU_LOCAL don't contend.
+A new source claims a free slot with a CAS on key, or the least recently seen
+idle one among SOURCE_PROBE slots after its hash (approximate LRU): active
+goes 0 -> -1 while the slot is rewritten, so nobody enters a slot being
+replaced. If all of them have open connections it is not tracked and not
+limited. Relay threads just decrement active.
+*/
+typedef struct {
+    uint64_t key;       /* FNV-1a of address, 0 - free */
+    uint8_t family;     /* 0 while addr is written */
+    uint64_t addr[2];   /* address bytes, read and written as atomic words */
+    int active;         /* open connections, -1 while the slot is replaced */
+    int64_t tokens;     /* thousandths of a connection */
+    int64_t refilled_ns;
+    int64_t seen_ns;
+    uint64_t accepted;
+    uint64_t rejected;
+} source_t;
+
+static source_t sources[SOURCE_TABLE_SIZE];
+static int source_max_active = 0;   /* -m, 0 - unlimited */
+static int64_t source_rate = 0;     /* -r, connections per second, 0 - unlimited */
+
+/* address bytes of client, 0 for addresses without limits (unix sockets) */
+int source_addr(const struct sockaddr_storage *sa, uint8_t addr[16]) {
+    memset(addr, 0, 16);
+    if (sa->ss_family == AF_INET) {
+        memcpy(addr, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+        return AF_INET;
+    }
+    if (sa->ss_family == AF_INET6) {
+        memcpy(addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+        return AF_INET6;
+    }
+    return 0;
+}
+
+/* 0 if the slot is being filled */
+int source_load(source_t *s, uint8_t addr[16]) {
+    int family = __atomic_load_n(&s->family, __ATOMIC_ACQUIRE);
+    uint64_t words[2] = {__atomic_load_n(&s->addr[0], __ATOMIC_RELAXED), __atomic_load_n(&s->addr[1], __ATOMIC_RELAXED)};
+    memcpy(addr, words, 16);
+    return family;
+}
+
+/* a slot still being filled is taken by its key alone */
+int source_same(source_t *s, int family, const uint8_t addr[16]) {
+    uint8_t slot_addr[16];
+    int f = source_load(s, slot_addr);
+    return f == 0 || (f == family && memcmp(slot_addr, addr, 16) == 0);
+}
+
+void source_fill(source_t *s, int family, const uint8_t addr[16]) {
+    uint64_t words[2];
+    memcpy(words, addr, 16);
+    __atomic_store_n(&s->addr[0], words[0], __ATOMIC_RELAXED);
+    __atomic_store_n(&s->addr[1], words[1], __ATOMIC_RELAXED);
+    __atomic_store_n(&s->family, (uint8_t)family, __ATOMIC_RELEASE);
+}
+
+source_t *source_get(const struct sockaddr_storage *sa, int64_t now, uint64_t *key_out) {
+    uint8_t addr[16];
+    int family = source_addr(sa, addr);
+    if (!family) return NULL;
+    uint8_t family_byte = (uint8_t)family;
+    uint64_t key = fnv1a(addr, 16, fnv1a(&family_byte, 1, FNV1A_SEED));
+    if (key == 0) key = 1;
+    *key_out = key;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        source_t *victim = NULL;
+        uint64_t victim_key = 0;
+        for (int i = 0; i < SOURCE_PROBE; i++) {
+            source_t *s = &sources[(key + i) & (SOURCE_TABLE_SIZE - 1)];
+            uint64_t k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+            if (k == key && source_same(s, family, addr)) return s;
+            if (victim && victim_key == 0) continue; /* free slot found, keep looking for the key only */
+            if (k == 0) {
+                victim = s;
+                victim_key = 0;
+            } else if (__atomic_load_n(&s->active, __ATOMIC_ACQUIRE) == 0 &&
+                       (!victim || __atomic_load_n(&s->seen_ns, __ATOMIC_RELAXED) < __atomic_load_n(&victim->seen_ns, __ATOMIC_RELAXED))) {
+                victim = s;
+                victim_key = k;
+            }
+        }
+        if (!victim) return NULL;
+        if (victim_key == 0) {
+            /* free slots were never used, their counters are still zero */
+            if (__atomic_compare_exchange_n(&victim->key, &victim_key, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                source_fill(victim, family, addr);
+                return victim;
+            }
+            continue; /* taken meanwhile, maybe by the same source */
+        }
+        int idle = 0;
+        if (!__atomic_compare_exchange_n(&victim->active, &idle, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) continue;
+        uint8_t old_family = __atomic_exchange_n(&victim->family, 0, __ATOMIC_ACQ_REL);
+        if (__atomic_compare_exchange_n(&victim->key, &victim_key, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&victim->tokens, source_rate * 1000, __ATOMIC_RELAXED);
+            __atomic_store_n(&victim->refilled_ns, now, __ATOMIC_RELAXED);
+            __atomic_store_n(&victim->accepted, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&victim->rejected, 0, __ATOMIC_RELAXED);
+            source_fill(victim, family, addr);
+            __atomic_store_n(&victim->active, 0, __ATOMIC_RELEASE);
+            return victim;
+        }
+        __atomic_store_n(&victim->family, old_family, __ATOMIC_RELEASE);
+        __atomic_store_n(&victim->active, 0, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+1 if a connection was added to s (active stays under limit when limit > 0),
+0 if over limit, -1 if s is being replaced or already holds another source
+*/
+int source_enter(source_t *s, uint64_t key, int limit) {
+    int active = __atomic_load_n(&s->active, __ATOMIC_ACQUIRE);
+    do {
+        if (active < 0) return -1;
+        if (limit && active >= limit) return 0;
+    } while (!__atomic_compare_exchange_n(&s->active, &active, active + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    if (__atomic_load_n(&s->key, __ATOMIC_ACQUIRE) != key) {
+        __atomic_sub_fetch(&s->active, 1, __ATOMIC_ACQ_REL);
+        return -1;
+    }
+    return 1;
+}
+
+/* refill by the time since the last refill (whoever moves refilled_ns adds it) and take one token */
+int source_take_token(source_t *s, int64_t now) {
+    int64_t burst = source_rate * 1000;
+    int64_t last = __atomic_load_n(&s->refilled_ns, __ATOMIC_ACQUIRE);
+    if (now > last && __atomic_compare_exchange_n(&s->refilled_ns, &last, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        int64_t elapsed = now - last;
+        if (elapsed > 1000000000) elapsed = 1000000000; /* a second refills the whole burst */
+        int64_t add = elapsed * source_rate / 1000000;
+        int64_t tokens = __atomic_load_n(&s->tokens, __ATOMIC_ACQUIRE);
+        int64_t next;
+        do {
+            next = tokens + add > burst ? burst : tokens + add;
+        } while (!__atomic_compare_exchange_n(&s->tokens, &tokens, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    }
+    int64_t tokens = __atomic_load_n(&s->tokens, __ATOMIC_ACQUIRE);
+    do {
+        if (tokens < 1000) return 0;
+    } while (!__atomic_compare_exchange_n(&s->tokens, &tokens, tokens - 1000, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return 1;
+}
+
+/* 1 and *out set (may be NULL for untracked) if the client may connect */
+int source_admit(const struct sockaddr_storage *sa, source_t **out) {
+    int64_t now = now_ns();
+    uint64_t key;
+    source_t *s = source_get(sa, now, &key);
+    *out = NULL;
+    if (!s) return 1;
+    __atomic_store_n(&s->seen_ns, now, __ATOMIC_RELAXED);
+    int ok = source_enter(s, key, source_max_active);
+    if (ok < 0) return 1; /* replaced under us, let it through untracked */
+    if (ok && source_rate && !source_take_token(s, now)) {
+        __atomic_sub_fetch(&s->active, 1, __ATOMIC_ACQ_REL);
+        ok = 0;
+    }
+    if (!ok) {
+        uint64_t rejected = __atomic_add_fetch(&s->rejected, 1, __ATOMIC_RELAXED);
+        if ((rejected & (rejected - 1)) == 0) {
+            char ip[INET6_ADDRSTRLEN];
+            uint8_t addr[16];
+            inet_ntop(source_addr(sa, addr), addr, ip, sizeof(ip));
+            LOG(LOG_INFO, "source %s over limit, %u connections rejected", ip, (int64_t)rejected, 0);
+        }
+        return 0;
+    }
+    __atomic_add_fetch(&s->accepted, 1, __ATOMIC_RELAXED);
+    *out = s;
+    return 1;
+}
+
+/* connections taken over by hot upgrade, counted but not limited */
+source_t *source_track(const struct sockaddr_storage *sa) {
+    uint64_t key;
+    source_t *s = source_get(sa, now_ns(), &key);
+    return s && source_enter(s, key, 0) > 0 ? s : NULL;
+}
+
+void source_release(source_t *s) {
+    if (s) __atomic_sub_fetch(&s->active, 1, __ATOMIC_ACQ_REL);
+}
+
+#ifdef METRICS
+void source_metrics(FILE *out) {
+    static const char *names[3] = {"proxy_source_active", "proxy_source_accepted_total", "proxy_source_rejected_total"};
+    for (int m = 0; m < 3; m++) {
+        fprintf(out, "# TYPE %s %s\n", names[m], m == 0 ? "gauge" : "counter");
+        for (int i = 0; i < SOURCE_TABLE_SIZE; i++) {
+            source_t *s = &sources[i];
+            uint8_t addr[16];
+            int family = source_load(s, addr);
+            int active = __atomic_load_n(&s->active, __ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&s->key, __ATOMIC_ACQUIRE) == 0 || family == 0 || active < 0) continue;
+            char ip[INET6_ADDRSTRLEN];
+            inet_ntop(family, addr, ip, sizeof(ip));
+            unsigned long long v = m == 0 ? (unsigned long long)active :
+                                   m == 1 ? __atomic_load_n(&s->accepted, __ATOMIC_RELAXED) : __atomic_load_n(&s->rejected, __ATOMIC_RELAXED);
+            fprintf(out, "%s{source=\"%s\"} %llu\n", names[m], ip, v);
+        }
+    }
+}
+#endif
+#endif
+
+typedef struct client {
+    struct client *next; /* accept queue */
+    int fd;
+    struct sockaddr_storage addr;
+#ifdef SOURCE_LIMITS
+    source_t *source;
+#endif
+} client_t;
+
+enum { PIPE_RUNNING = 0, PIPE_PARKED, PIPE_DONE };
+
+typedef struct tunnel tunnel_t;
+
+typedef struct {
+    tunnel_t *tunnel;
+    int from_fd;
+    int to_fd;
+    int state;
+    size_t pending; /* bytes in buffer, buffer[sent..pending) is not written yet */
+    size_t sent;
+    char buffer[BUFFER_SIZE];
+#ifdef HOT_UPGRADE
+    pthread_t thread;
+#endif
+#ifdef FAIR_SCHEDULER
+    sched_flow_t flow;
+#endif
+#ifdef ADAPTIVE_FRAGMENT
+    int watch_handshake;
+    frag_strategy_t strategy;
+    char host[256];
+#endif
+#ifdef SOCKET_PROFILES
+    int64_t window_start_ns;
+    size_t window_bytes;
+    int bulk;
+#endif
+} pipe_args_t;
+
+struct tunnel {
+#ifdef HOT_UPGRADE
+    tunnel_t *next;
+    tunnel_t *prev;
+#endif
+    int client_fd;
+    int remote_fd;
+    int refs; /* directions not done yet, the last one closes sockets */
+#ifdef FAIR_SCHEDULER
+    struct sockaddr_storage addr;
+    uint64_t sched_bytes; /* both directions, for PRIORITY_BYTES */
+#endif
+#ifdef SOCKET_PROFILES
+    int profile;
+#endif
+#ifdef SOURCE_LIMITS
+    source_t *source;
+#endif
+#ifdef CPU_LOCAL
+    int cpu; /* incoming CPU of the client socket, -1 - not counted */
+#endif
+    pipe_args_t dirs[2];
+};
+
+#ifdef HOT_UPGRADE
+static tunnel_t *tunnel_list = NULL;
+static pthread_mutex_t tunnels_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tunnels_cond = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t upgrading = 0;
+static int handshakes = 0;
+#endif
+
+#ifdef ADAPTIVE_FRAGMENT
+void strategy_report(const char *host, frag_strategy_t used, int ok);
+#ifdef WARM_CACHE
+void warm_put_strategy(const char *host, int strategy, int floor, time_t expires);
+#endif
+#endif
+
+ssize_t read_n(int fd, void *buf, size_t n) {
+    size_t total = 0;
+    while (total < n) {
+        ssize_t r = read(fd, (char*)buf + total, n - total);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return r;
+        total += r;
+    }
+    return total;
+}
+
+/* read_n on a blocking socket that gives up at deadline (now_ns clock), -1 with ETIMEDOUT */
+ssize_t read_n_until(int fd, void *buf, size_t n, int64_t deadline) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    size_t total = 0;
+    while (total < n) {
+        int64_t left_ms = (deadline - now_ns()) / 1000000;
+        int ready = left_ms > 0 ? poll(&pfd, 1, (int)left_ms) : 0;
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready == 0) errno = ETIMEDOUT;
+        if (ready <= 0) return -1;
+        ssize_t r = read(fd, (char*)buf + total, n - total);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return r;
+        total += r;
+    }
+    return total;
+}
+
+ssize_t write_n(int fd, const void *buf, size_t n) {
+    size_t total = 0;
+    while (total < n) {
+        ssize_t w = write(fd, (const char*)buf + total, n - total);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return w;
+        total += w;
+    }
+    return total;
+}
+
+#ifdef METRICS
+static uint64_t metrics_accepted = 0;
+static int metrics_tunnels = 0;
+#endif
+
+#ifdef CPU_LOCAL
+/*
+CPU local tunnels. SO_INCOMING_CPU of a client socket is the core whose
+softirq handles its packets. A handshake that starts on another core is a
+cross-core handoff; with -C the handshake thread moves to that core before it
+connects upstream, so the upstream socket and the relay threads it creates
+(they inherit its affinity) live there too; a pooled handshake thread gets
+its own affinity back before it takes the next client. Not the default: with a single
+NIC queue every tunnel would end up on one core.
+*/
+static int cpu_pin = 0;       /* -C */
+static int cpu_reuseport = 0; /* -P */
+static int cpu_count = 1;
+static int cpu_tunnels[CPU_LOCAL_MAX];
+static uint64_t cpu_handoffs[CPU_LOCAL_MAX];
+static __thread int cpu_bound = 0; /* cpu_bind_thread changed the affinity of this thread */
+
+void cpu_bind_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
     if (err != 0) {
-#ifdef DEBUG
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
-        fprintf(stderr, "connect_remote: host='%s', port='%s'\n", host, port);
+        errno = err;
+        LOG_ERRNO(LOG_DEBUG, "pthread_setaffinity_np %d", NULL, cpu, 0);
+        return;
+    }
+    cpu_bound = 1;
+}
+
+/* a pooled handshake thread gives up the core of its last client, saved is its affinity from before */
+void cpu_local_leave(const cpu_set_t *saved) {
+    if (!cpu_bound) return;
+    pthread_setaffinity_np(pthread_self(), sizeof(*saved), saved);
+    cpu_bound = 0;
+}
+
+/* incoming CPU of fd (-1 if unknown), with -C the calling thread moves there */
+int cpu_local_enter(int fd) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0 || cpu < 0 || cpu >= cpu_count) return -1;
+    if (sched_getcpu() != cpu) __atomic_add_fetch(&cpu_handoffs[cpu], 1, __ATOMIC_RELAXED);
+    if (cpu_pin) cpu_bind_thread(cpu);
+    return cpu;
+}
+
+#ifdef METRICS
+void cpu_metrics(FILE *out) {
+    fprintf(out, "# TYPE proxy_cpu_tunnels gauge\n");
+    for (int c = 0; c < cpu_count; c++) {
+        fprintf(out, "proxy_cpu_tunnels{cpu=\"%d\"} %d\n", c, __atomic_load_n(&cpu_tunnels[c], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# TYPE proxy_cpu_handoffs_total counter\n");
+    for (int c = 0; c < cpu_count; c++) {
+        fprintf(out, "proxy_cpu_handoffs_total{cpu=\"%d\"} %llu\n", c,
+                (unsigned long long)__atomic_load_n(&cpu_handoffs[c], __ATOMIC_RELAXED));
+    }
+}
+#endif
+#endif
+
+tunnel_t *tunnel_new(int client_fd, int remote_fd) {
+    tunnel_t *t = calloc(1, sizeof(tunnel_t));
+    if (!t) return NULL;
+#ifdef METRICS
+    __sync_add_and_fetch(&metrics_tunnels, 1);
+#endif
+    t->client_fd = client_fd;
+    t->remote_fd = remote_fd;
+    t->refs = 2;
+#ifdef CPU_LOCAL
+    t->cpu = -1;
+#endif
+    t->dirs[0].from_fd = client_fd;
+    t->dirs[0].to_fd = remote_fd;
+    t->dirs[1].from_fd = remote_fd;
+    t->dirs[1].to_fd = client_fd;
+    for (int d = 0; d < 2; d++) {
+        t->dirs[d].tunnel = t;
+        t->dirs[d].state = PIPE_PARKED;
+    }
+    return t;
+}
+
+#ifdef SOCKET_PROFILES
+/*
+Socket profiles. Both legs get the handshake profile right after connect, so
+fragments and handshake records leave without Nagle delay. Once the tunnel
+relays traffic every direction measures its rate over PROFILE_WINDOW_MS: a
+tunnel is bulk while any direction moves at least PROFILE_BULK_RATE bytes per
+second, otherwise interactive, and both legs are switched on every change.
+Bulk gets Nagle, big send buffer and PROFILE_BULK_CC congestion control,
+interactive keeps only PROFILE_LOWAT unsent bytes in the kernel (less
+queueing in front of small writes) and acks at once; quick ack is not sticky,
+the reading side re-arms it once per window. A tunnel that falls back from
+bulk gets the system default congestion control and send buffer size again
+(send buffer autotuning stays off, the kernel has no way to turn it back on).
+Options the kernel does not have (e.g. bbr module not loaded) are skipped.
+*/
+enum { PROFILE_HANDSHAKE = 0, PROFILE_INTERACTIVE, PROFILE_BULK };
+
+static const char *profile_names[] = {"handshake", "interactive", "bulk"};
+static char profile_default_cc[16] = "";
+static int profile_default_sndbuf = 0;
+
+/* startup: defaults a socket gets, restored when a tunnel stops being bulk */
+void profile_init(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return;
+    socklen_t len = sizeof(profile_default_cc) - 1;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, profile_default_cc, &len) < 0) profile_default_cc[0] = 0;
+    len = sizeof(profile_default_sndbuf);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &profile_default_sndbuf, &len) < 0) profile_default_sndbuf = 0;
+    close(fd);
+}
+
+void profile_apply(int fd, int profile, int old) {
+    int nodelay = profile != PROFILE_BULK;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (profile == PROFILE_BULK) {
+        int sndbuf = PROFILE_BULK_SNDBUF;
+        unsigned int lowat = UINT_MAX;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, PROFILE_BULK_CC, strlen(PROFILE_BULK_CC)) < 0) {
+            LOG_ERRNO(LOG_DEBUG, "congestion control %s", PROFILE_BULK_CC, 0, 0);
+        }
+    } else if (profile == PROFILE_INTERACTIVE) {
+        unsigned int lowat = PROFILE_LOWAT;
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+        if (old == PROFILE_BULK) {
+            int sndbuf = profile_default_sndbuf / 2; /* the kernel doubles what it is given */
+            if (sndbuf > 0) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+            if (profile_default_cc[0]) {
+                setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, profile_default_cc, strlen(profile_default_cc));
+            }
+        }
+    }
+    if (profile != PROFILE_BULK) {
+        int quickack = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+    }
+}
+
+/* called by pipe_data after every read */
+void profile_account(pipe_args_t *p, size_t n) {
+    tunnel_t *t = p->tunnel;
+    int64_t now = now_ns();
+    if (p->window_start_ns == 0) p->window_start_ns = now;
+    p->window_bytes += n;
+    int64_t elapsed = now - p->window_start_ns;
+    if (elapsed >= (int64_t)PROFILE_WINDOW_MS * 1000000) {
+        p->bulk = (int64_t)p->window_bytes * 1000000000 / elapsed >= PROFILE_BULK_RATE;
+        p->window_start_ns = now;
+        p->window_bytes = 0;
+        int other_bulk = t->dirs[&t->dirs[0] == p].bulk;
+        int profile = p->bulk || other_bulk ? PROFILE_BULK : PROFILE_INTERACTIVE;
+        int old = t->profile;
+        if (profile != old && __sync_bool_compare_and_swap(&t->profile, old, profile)) {
+            profile_apply(t->client_fd, profile, old);
+            profile_apply(t->remote_fd, profile, old);
+            LOG(LOG_DEBUG, "tunnel switched to %s profile", profile_names[profile], 0, 0);
+        } else if (profile != PROFILE_BULK) {
+            /* quick ack is not sticky, the kernel drops it after a while */
+            int quickack = 1;
+            setsockopt(p->from_fd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+        }
+    }
+}
+#endif
+
+void *pipe_data(void *arg);
+
+/* starts relay threads for directions that are not done */
+void tunnel_start(tunnel_t *t) {
+#ifdef HOT_UPGRADE
+    pthread_mutex_lock(&tunnels_lock);
+    t->prev = NULL;
+    t->next = tunnel_list;
+    if (tunnel_list) tunnel_list->prev = t;
+    tunnel_list = t;
+#endif
+    for (int d = 0; d < 2; d++) {
+        pipe_args_t *p = &t->dirs[d];
+        if (p->state == PIPE_DONE) continue;
+        p->state = PIPE_RUNNING;
+#ifdef FAIR_SCHEDULER
+        sched_flow_init(&p->flow, d == 0 ? SCHED_UP : SCHED_DOWN, &t->addr, &t->sched_bytes);
+#endif
+        pthread_t tid;
+        pthread_create(&tid, NULL, pipe_data, p);
+        pthread_detach(tid);
+#ifdef HOT_UPGRADE
+        p->thread = tid;
+#endif
+    }
+#ifdef HOT_UPGRADE
+    pthread_mutex_unlock(&tunnels_lock);
+#endif
+}
+
+void tunnel_release(pipe_args_t *p, int state) {
+    tunnel_t *t = p->tunnel;
+#ifdef FAIR_SCHEDULER
+    sched_flow_destroy(&p->flow);
+#endif
+#ifdef HOT_UPGRADE
+    pthread_mutex_lock(&tunnels_lock);
+    p->state = state;
+    int last = state == PIPE_DONE && --t->refs == 0;
+    if (last) {
+        if (t->prev) t->prev->next = t->next;
+        else tunnel_list = t->next;
+        if (t->next) t->next->prev = t->prev;
+    }
+    pthread_cond_broadcast(&tunnels_cond);
+    pthread_mutex_unlock(&tunnels_lock);
+#else
+    p->state = state;
+    int last = __sync_sub_and_fetch(&t->refs, 1) == 0;
+#endif
+    if (last) {
+        close(t->client_fd);
+        close(t->remote_fd);
+#ifdef SOURCE_LIMITS
+        source_release(t->source);
+#endif
+#ifdef METRICS
+        __sync_sub_and_fetch(&metrics_tunnels, 1);
+#endif
+#ifdef CPU_LOCAL
+        if (t->cpu >= 0) __sync_sub_and_fetch(&cpu_tunnels[t->cpu], 1);
+#endif
+        free(t);
+    }
+}
+
+void *pipe_data(void *arg) {
+    pipe_args_t *p = (pipe_args_t *)arg;
+    ssize_t n = 0;
+#ifdef ADAPTIVE_FRAGMENT
+    if (p->watch_handshake) {
+        p->watch_handshake = 0;
+        struct pollfd pfd = {p->from_fd, POLLIN, 0};
+        int ok = poll(&pfd, 1, HANDSHAKE_TIMEOUT_MS) > 0 && recv(p->from_fd, p->buffer, 1, MSG_PEEK) > 0;
+#ifdef HOT_UPGRADE
+        if (!upgrading)
+#endif
+        strategy_report(p->host, p->strategy, ok);
+    }
+#endif
+    while (1) {
+        while (p->sent < p->pending) {
+            ssize_t w = write(p->to_fd, p->buffer + p->sent, p->pending - p->sent);
+            if (w < 0 && errno == EINTR) {
+#ifdef HOT_UPGRADE
+                if (upgrading) goto park;
+#endif
+                continue;
+            }
+            if (w <= 0) {
+                if (w < 0) {
+                    if (errno == EPIPE || errno == ECONNRESET) {
+                        goto cleanup;
+                    }
+                    LOG_ERRNO(LOG_DEBUG, "write", NULL, 0, 0);
+                }
+                goto cleanup;
+            }
+            p->sent += w;
+        }
+        p->pending = p->sent = 0;
+#ifdef HOT_UPGRADE
+        if (upgrading) goto park;
+#endif
+        n = read(p->from_fd, p->buffer, sizeof(p->buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+#ifdef SOCKET_PROFILES
+        profile_account(p, (size_t)n);
+#endif
+#ifdef FAIR_SCHEDULER
+        sched_acquire(&p->flow, (size_t)n);
+#endif
+        p->pending = (size_t)n;
+    }
+    if (n < 0) {
+        LOG_ERRNO(LOG_DEBUG, "read", NULL, 0, 0);
+    }
+cleanup:
+    shutdown(p->to_fd, SHUT_WR);
+    shutdown(p->from_fd, SHUT_RD);
+    tunnel_release(p, PIPE_DONE);
+    return NULL;
+#ifdef HOT_UPGRADE
+park:
+    tunnel_release(p, PIPE_PARKED);
+    return NULL;
+#endif
+}
+
+/* fragmentation output: bytes for remote and where every separate write ends */
+typedef struct {
+    uint8_t buf[FRAG_OUT_SIZE];
+    size_t len;
+    size_t ends[FRAG_MAX_SEGMENTS];
+    int segments;
+    int nodelay;
+} frag_out_t;
+
+typedef void (*frag_fn_t)(frag_out_t *out, const uint8_t *head, const uint8_t *data, size_t data_len, size_t sni_start, size_t sni_end);
+
+const char *const frag_strategy_names[FRAG_STRATEGY_COUNT] = {"none", "tcp_split", "record_split", "sni_chunks"};
+
+int find_sni(const uint8_t *data, size_t data_len, size_t *sni_start, size_t *sni_end) {
+    for (size_t i = 0; i + 8 < data_len; i++) {
+        if (data[i + 0] == 0x00 && data[i + 1] == 0x00 && data[i + 2] == 0x00 && data[i + 4] == 0x00 && data[i + 6] == 0x00 && data[i + 7] == 0x00) {
+            uint8_t ext_len = data[i + 3];
+            uint8_t server_name_list_len = data[i + 5];
+            uint8_t server_name_len = data[i + 8];
+            if ((int)ext_len - (int)server_name_list_len == 2 && 
+                (int)server_name_list_len - (int)server_name_len == 3) {
+                *sni_start = i + 9;
+                *sni_end = *sni_start + server_name_len;
+                return *sni_end <= data_len;
+            }
+        }
+    }
+    return 0;
+}
+
+void frag_put(frag_out_t *out, const uint8_t *bytes, size_t len) {
+    memcpy(out->buf + out->len, bytes, len);
+    out->len += len;
+}
+
+void frag_segment(frag_out_t *out) {
+    if (out->len > (out->segments ? out->ends[out->segments - 1] : 0)) {
+        out->ends[out->segments++] = out->len;
+    }
+}
+
+void frag_record(frag_out_t *out, const uint8_t *payload, size_t len) {
+    if (len == 0) return;
+    uint8_t header[5] = {0x16, 0x03, 0x04, (uint8_t)(len >> 8), (uint8_t)len};
+    frag_put(out, header, 5);
+    frag_put(out, payload, len);
+    frag_segment(out);
+}
+
+void frag_none(frag_out_t *out, const uint8_t *head, const uint8_t *data, size_t data_len, size_t sni_start, size_t sni_end) {
+    (void)sni_start;
+    (void)sni_end;
+    frag_put(out, head, 5);
+    frag_put(out, data, data_len);
+    frag_segment(out);
+}
+
+void frag_tcp_split(frag_out_t *out, const uint8_t *head, const uint8_t *data, size_t data_len, size_t sni_start, size_t sni_end) {
+    size_t mid = sni_start + (sni_end - sni_start) / 2;
+    out->nodelay = 1;
+    frag_put(out, head, 5);
+    frag_put(out, data, mid);
+    frag_segment(out);
+    frag_put(out, data + mid, data_len - mid);
+    frag_segment(out);
+}
+
+void frag_record_split(frag_out_t *out, const uint8_t *head, const uint8_t *data, size_t data_len, size_t sni_start, size_t sni_end) {
+    (void)head;
+    size_t mid = sni_start + (sni_end - sni_start) / 2;
+    frag_record(out, data, mid);
+    frag_record(out, data + mid, data_len - mid);
+}
+
+void frag_sni_chunks(frag_out_t *out, const uint8_t *head, const uint8_t *data, size_t data_len, size_t sni_start, size_t sni_end) {
+    (void)head;
+    frag_record(out, data, sni_start);
+    for (size_t i = sni_start; i < sni_end; i += SNI_CHUNK_SIZE) {
+        size_t chunk_len = (sni_end - i >= SNI_CHUNK_SIZE) ? SNI_CHUNK_SIZE : (sni_end - i);
+        frag_record(out, data + i, chunk_len);
+    }
+    frag_record(out, data + sni_end, data_len - sni_end);
+}
+
+static const frag_fn_t frag_strategies[FRAG_STRATEGY_COUNT] = {
+    frag_none,
+    frag_tcp_split,
+    frag_record_split,
+    frag_sni_chunks
+};
+
+/* head is the TLS record header, data is what was read of its body (at most 2048 bytes) */
+int frag_build(frag_out_t *out, frag_strategy_t strategy, const uint8_t *head, const uint8_t *data, size_t data_len) {
+    size_t sni_start = 0;
+    size_t sni_end = 0;
+    out->len = 0;
+    out->segments = 0;
+    out->nodelay = 0;
+    if (strategy != FRAG_NONE && !find_sni(data, data_len, &sni_start, &sni_end)) {
+        return -1;
+    }
+    frag_strategies[strategy](out, head, data, data_len, sni_start, sni_end);
+    return 0;
+}
+
+/* TCP_NODELAY is only on for the split writes, the previous setting is restored after them */
+int frag_send(int remote_fd, const frag_out_t *out) {
+    int old = 0, opt = 1, result = 0;
+    socklen_t opt_len = sizeof(old);
+    if (out->nodelay) {
+        if (getsockopt(remote_fd, IPPROTO_TCP, TCP_NODELAY, &old, &opt_len) < 0) old = 0;
+        if (!old) setsockopt(remote_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    size_t start = 0;
+    for (int i = 0; i < out->segments; i++) {
+        if (write_n(remote_fd, out->buf + start, out->ends[i] - start) < 0) {
+            result = -1;
+            break;
+        }
+        start = out->ends[i];
+    }
+    if (out->nodelay && !old) setsockopt(remote_fd, IPPROTO_TCP, TCP_NODELAY, &old, sizeof(old));
+    return result;
+}
+
+#ifdef HELLO_CAPTURE
+/*
+ClientHello corpus: every record is 4 bytes big endian length followed by the
+bytes fragment_data read (5 byte TLS record header and up to 2048 bytes of body).
+*/
+static FILE *capture_file = NULL;
+static int capture_anonymize = 0;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void random_bytes(uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) p[i] = (uint8_t)rand();
+}
+
+/* replaces client random, session id and server name letters, keeps lengths and dots */
+void hello_anonymize(uint8_t *data, size_t len) {
+    size_t sni_start, sni_end;
+    if (len >= 6 + 32) random_bytes(data + 6, 32);
+    if (len >= 39 && 39 + (size_t)data[38] <= len) random_bytes(data + 39, data[38]);
+    if (find_sni(data, len, &sni_start, &sni_end)) {
+        for (size_t i = sni_start; i < sni_end; i++) {
+            if (data[i] != '.') data[i] = 'a' + rand() % 26;
+        }
+    }
+}
+
+void hello_capture(const uint8_t *head, const uint8_t *data, size_t len) {
+    uint8_t copy[2048];
+    memcpy(copy, data, len);
+    if (capture_anonymize) hello_anonymize(copy, len);
+    uint32_t len_be = htonl((uint32_t)(5 + len));
+    pthread_mutex_lock(&capture_lock);
+    if (fwrite(&len_be, 4, 1, capture_file) != 1 || fwrite(head, 5, 1, capture_file) != 1 ||
+        fwrite(copy, len, 1, capture_file) != 1 || fflush(capture_file) != 0) {
+        LOG_ERRNO(LOG_WARNING, "capture: write failed", NULL, 0, 0);
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
 #endif
+
+/* early - bytes the client sent right after its request, they are read first */
+int fragment_data(int local_fd, int remote_fd, frag_strategy_t strategy, const uint8_t *early, size_t early_len) {
+    uint8_t head[5];
+    size_t have = early_len < 5 ? early_len : 5;
+    if (have) memcpy(head, early, have);
+    if (have < 5 && read_n(local_fd, head + have, 5 - have) != (ssize_t)(5 - have)) return -1;
+    early += have;
+    early_len -= have;
+    uint8_t data[2048];
+    ssize_t n;
+    if (early_len) {
+        n = early_len < sizeof(data) ? (ssize_t)early_len : (ssize_t)sizeof(data);
+        memcpy(data, early, n);
+        early += n;
+        early_len -= n;
+    } else {
+        n = read(local_fd, data, sizeof(data));
+        if (n <= 0) return -1;
+    }
+#ifdef HELLO_CAPTURE
+    if (capture_file) hello_capture(head, data, (size_t)n);
+#endif
+    frag_out_t out;
+    if (frag_build(&out, strategy, head, data, (size_t)n) < 0) return -1;
+    if (frag_send(remote_fd, &out) < 0) return -1;
+    if (early_len && write_n(remote_fd, early, early_len) != (ssize_t)early_len) return -1;
+    return 0;
+}
+
+#ifdef ADAPTIVE_FRAGMENT
+/*
+Per-host strategy cache. Unknown hosts start with the strongest strategy,
+after STRATEGY_PROBE_AFTER successful handshakes the next cheaper one is tried,
+a failed handshake moves the host back up and never probes below it again until
+the entry expires. Success means upstream sent something after the ClientHello.
+*/
+typedef struct {
+    char host[256];
+    uint8_t strategy;   /* strategy for new tunnels */
+    uint8_t floor;      /* cheapest strategy still allowed to probe */
+    uint8_t successes;  /* consecutive successes with current strategy */
+    time_t expires;
+} strategy_entry_t;
+
+static strategy_entry_t strategy_cache[STRATEGY_CACHE_SIZE];
+static pthread_mutex_t strategy_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *strategy_cache_file = NULL;
+static time_t strategy_saved_at = 0;
+static int strategy_dirty = 0;
+
+/* caller holds strategy_lock */
+strategy_entry_t *strategy_slot(const char *host, int create, time_t now) {
+    uint64_t h = host_hash(host, FNV1A_SEED);
+    strategy_entry_t *victim = NULL;
+    for (int i = 0; i < STRATEGY_PROBE_LIMIT; i++) {
+        strategy_entry_t *e = &strategy_cache[(h + i) % STRATEGY_CACHE_SIZE];
+        if (e->host[0] && e->expires > now && strcasecmp(e->host, host) == 0) return e;
+        if (!create) continue;
+        if (!e->host[0] || e->expires <= now) {
+            if (!victim || victim->host[0]) victim = e;
+        } else if (!victim || (victim->host[0] && e->expires < victim->expires)) {
+            victim = e;
+        }
+    }
+    if (!create) return NULL;
+    memset(victim, 0, sizeof(*victim));
+    snprintf(victim->host, sizeof(victim->host), "%s", host);
+    victim->strategy = FRAG_STRONGEST;
+    victim->floor = FRAG_NONE;
+    return victim;
+}
+
+void strategy_load(void) {
+    FILE *f = fopen(strategy_cache_file, "r");
+    if (!f) return;
+    char host[256];
+    unsigned strategy, floor;
+    long long expires;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&strategy_lock);
+    while (fscanf(f, "%255s %u %u %lld", host, &strategy, &floor, &expires) == 4) {
+        if (expires <= now || strategy >= FRAG_STRATEGY_COUNT || floor > strategy) continue;
+        strategy_entry_t *e = strategy_slot(host, 1, now);
+        e->strategy = (uint8_t)strategy;
+        e->floor = (uint8_t)floor;
+        e->expires = (time_t)expires;
+    }
+    pthread_mutex_unlock(&strategy_lock);
+    fclose(f);
+}
+
+/* caller holds strategy_lock */
+void strategy_save(time_t now) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", strategy_cache_file);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        LOG_ERRNO(LOG_WARNING, "strategy cache: can't write %s", tmp, 0, 0);
+        return;
+    }
+    for (int i = 0; i < STRATEGY_CACHE_SIZE; i++) {
+        strategy_entry_t *e = &strategy_cache[i];
+        if (!e->host[0] || e->expires <= now) continue;
+        fprintf(f, "%s %u %u %lld\n", e->host, e->strategy, e->floor, (long long)e->expires);
+    }
+    if (fclose(f) == 0 && rename(tmp, strategy_cache_file) == 0) {
+        strategy_dirty = 0;
+    }
+    strategy_saved_at = now;
+}
+
+void strategy_flush(void) {
+    pthread_mutex_lock(&strategy_lock);
+    if (strategy_cache_file && strategy_dirty) {
+        strategy_save(time(NULL));
+    }
+    pthread_mutex_unlock(&strategy_lock);
+}
+
+frag_strategy_t strategy_get(const char *host) {
+    frag_strategy_t strategy = FRAG_STRONGEST;
+    pthread_mutex_lock(&strategy_lock);
+    strategy_entry_t *e = strategy_slot(host, 0, time(NULL));
+    if (e) strategy = (frag_strategy_t)e->strategy;
+    pthread_mutex_unlock(&strategy_lock);
+    return strategy;
+}
+
+void strategy_report(const char *host, frag_strategy_t used, int ok) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&strategy_lock);
+    strategy_entry_t *e = strategy_slot(host, 1, now);
+    if (ok) {
+        if (used == e->strategy && ++e->successes >= STRATEGY_PROBE_AFTER && e->strategy > e->floor) {
+            e->strategy--;
+            e->successes = 0;
+        }
+    } else if (used + 1 > e->floor) {
+        e->floor = (used < FRAG_STRONGEST) ? used + 1 : FRAG_STRONGEST;
+        if (e->strategy < e->floor) e->strategy = e->floor;
+        e->successes = 0;
+    }
+    LOG(LOG_DEBUG, ok ? "%s: handshake ok with strategy %d, next %d" : "%s: handshake failed with strategy %d, next %d",
+        host, used, e->strategy);
+    e->expires = now + STRATEGY_TTL;
+#ifdef WARM_CACHE
+    warm_put_strategy(e->host, e->strategy, e->floor, e->expires);
+#endif
+    strategy_dirty = 1;
+    if (strategy_cache_file && now - strategy_saved_at >= STRATEGY_SAVE_INTERVAL) {
+        strategy_save(now);
+    }
+    pthread_mutex_unlock(&strategy_lock);
+}
+#endif
+
+#ifdef CIRCUIT_BREAKER
+/*
+Circuit breaker per destination (host and port as the client named them).
+Connects are non-blocking with CONNECT_TIMEOUT_MS per address, so a
+blackholed origin costs seconds instead of the kernel SYN timeout.
+BREAKER_FAILURES failed connects (DNS failures and timeouts included) with
+less than BREAKER_WINDOW_MS between them open the breaker: for BREAKER_OPEN_MS
+every connect to the destination fails at once with the error of the last
+failure (the client gets 504 after a timeout, 502 otherwise). Then one
+connect is let through as a trial (half open) while the rest still fail
+fast; success closes the breaker, failure opens it again for twice as long,
+up to BREAKER_MAX_OPEN_MS. Only failing destinations are kept, in a table of
+BREAKER_SLOTS, a success frees the slot, a full probe window replaces the
+entry seen least recently.
+*/
+enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+typedef struct {
+    char host[256]; /* "" - free slot */
+    uint16_t port;
+    uint8_t state;
+    uint8_t probing;     /* half open: the trial connect is running */
+    uint32_t failures;   /* in a row, each within BREAKER_WINDOW_MS of the previous */
+    uint32_t opened;     /* opened in a row, doubles the open time */
+    int err;             /* of the last failure */
+    int64_t last_failure;
+    int64_t until;       /* open: fail fast until */
+    uint64_t fast_fails;
+} breaker_t;
+
+static breaker_t breakers[BREAKER_SLOTS];
+static pthread_mutex_t breaker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* caller holds breaker_lock */
+breaker_t *breaker_slot(const char *host, uint16_t port, int create) {
+    uint64_t h = host_hash(host, fnv1a(&port, sizeof(port), FNV1A_SEED));
+    breaker_t *victim = NULL;
+    for (int i = 0; i < BREAKER_PROBE; i++) {
+        breaker_t *b = &breakers[(h + i) % BREAKER_SLOTS];
+        if (b->host[0] && b->port == port && strcasecmp(b->host, host) == 0) return b;
+        if (!create) continue;
+        if (!b->host[0]) {
+            if (!victim || victim->host[0]) victim = b;
+        } else if (!victim || (victim->host[0] && b->last_failure < victim->last_failure)) {
+            victim = b;
+        }
+    }
+    if (!create || strlen(host) >= sizeof(victim->host)) return NULL;
+    memset(victim, 0, sizeof(*victim));
+    snprintf(victim->host, sizeof(victim->host), "%s", host);
+    victim->port = port;
+    return victim;
+}
+
+/* 0 - go ahead, -1 - fail fast, errno is the last failure */
+int breaker_check(const char *host, const char *port) {
+    int ret = 0;
+    pthread_mutex_lock(&breaker_lock);
+    breaker_t *b = breaker_slot(host, (uint16_t)atoi(port), 0);
+    if (b && b->state != BREAKER_CLOSED) {
+        if (b->state == BREAKER_OPEN && now_ns() >= b->until) {
+            b->state = BREAKER_HALF_OPEN;
+            b->probing = 0;
+        }
+        if (b->state == BREAKER_HALF_OPEN && !b->probing) {
+            b->probing = 1;
+            LOG(LOG_INFO, "breaker: %s:%d half open, trying", host, b->port, 0);
+        } else {
+            b->fast_fails++;
+            errno = b->err;
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&breaker_lock);
+    return ret;
+}
+
+/* result 1 - connected, -1 - failed with err, 0 - nothing was dialed */
+void breaker_report(const char *host, const char *port, int result, int err) {
+    uint16_t p = (uint16_t)atoi(port);
+    int64_t now = now_ns();
+    pthread_mutex_lock(&breaker_lock);
+    breaker_t *b = breaker_slot(host, p, result < 0);
+    if (!b) {
+        pthread_mutex_unlock(&breaker_lock);
+        return;
+    }
+    if (result > 0) {
+        if (b->state != BREAKER_CLOSED) LOG(LOG_INFO, "breaker: %s:%d closed", host, p, 0);
+        memset(b, 0, sizeof(*b));
+    } else if (result == 0) {
+        b->probing = 0;
+    } else {
+        if (b->state == BREAKER_CLOSED && now - b->last_failure > (int64_t)BREAKER_WINDOW_MS * 1000000) b->failures = 0;
+        b->failures++;
+        b->last_failure = now;
+        b->err = err;
+        if (b->state == BREAKER_HALF_OPEN || (b->state == BREAKER_CLOSED && b->failures >= BREAKER_FAILURES)) {
+            int64_t open_ms = BREAKER_OPEN_MS;
+            for (uint32_t i = 0; i < b->opened && open_ms < BREAKER_MAX_OPEN_MS; i++) open_ms *= 2;
+            if (open_ms > BREAKER_MAX_OPEN_MS) open_ms = BREAKER_MAX_OPEN_MS;
+            b->state = BREAKER_OPEN;
+            b->probing = 0;
+            b->opened++;
+            b->until = now + open_ms * 1000000;
+            LOG(LOG_INFO, "breaker: %s:%d open for %d ms", host, p, open_ms);
+        }
+    }
+    pthread_mutex_unlock(&breaker_lock);
+}
+
+#ifdef METRICS
+void breaker_metrics(FILE *out) {
+    static const char *names[3] = {"proxy_breaker_state", "proxy_breaker_failures", "proxy_breaker_fast_fails_total"};
+    static const char *states[3] = {"closed", "open", "half_open"};
+    pthread_mutex_lock(&breaker_lock);
+    for (int m = 0; m < 3; m++) {
+        fprintf(out, "# TYPE %s %s\n", names[m], m == 2 ? "counter" : "gauge");
+        for (int i = 0; i < BREAKER_SLOTS; i++) {
+            breaker_t *b = &breakers[i];
+            if (!b->host[0]) continue;
+            fprintf(out, "%s{destination=\"", names[m]);
+            for (const char *c = b->host; *c; c++) {
+                if (*c == '"' || *c == '\\') fputc('\\', out);
+                fputc(*c, out);
+            }
+            if (m == 0) {
+                fprintf(out, ":%u\",state=\"%s\"} 1\n", b->port, states[b->state]);
+            } else {
+                fprintf(out, ":%u\"} %llu\n", b->port, m == 1 ? (unsigned long long)b->failures : (unsigned long long)b->fast_fails);
+            }
+        }
+    }
+    pthread_mutex_unlock(&breaker_lock);
+}
+#endif
+#endif
+
+/* with CIRCUIT_BREAKER at most CONNECT_TIMEOUT_MS (errno ETIMEDOUT then), the socket stays blocking */
+int connect_timeout(int sock, const struct sockaddr *sa, socklen_t len) {
+#ifdef CIRCUIT_BREAKER
+    int flags = fcntl(sock, F_GETFL);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    int err = connect(sock, sa, len) == 0 ? 0 : errno;
+    if (err == EINPROGRESS) {
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        int64_t deadline = now_ns() + (int64_t)CONNECT_TIMEOUT_MS * 1000000;
+        int ready;
+        do {
+            int64_t left_ms = (deadline - now_ns()) / 1000000;
+            ready = left_ms > 0 ? poll(&pfd, 1, (int)left_ms) : 0;
+        } while (ready < 0 && errno == EINTR);
+        socklen_t err_len = sizeof(err);
+        if (ready == 0) err = ETIMEDOUT;
+        else if (ready < 0 || getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) err = errno;
+    }
+    fcntl(sock, F_SETFL, flags);
+    errno = err;
+    return err ? -1 : 0;
+#else
+    return connect(sock, sa, len);
+#endif
+}
+
+#ifdef CIDR_RULES
+/*
+Destination rules. -R file has one rule per line, "fragment", "bypass" or
+"deny" and an IPv4 or IPv6 prefix (address/length, a bare address is a host),
+# starts a comment. The longest prefix containing the address a tunnel
+connects to decides: deny - the address is not dialed (another address of the
+host may be), bypass - no fragmentation, fragment - fragmentation on any port,
+not only 443. Addresses no prefix covers are handled as before. Unlike host
+names this works for IP literals, SOCKS5 and ClientHellos without SNI.
+Prefixes are compiled into a poptrie per family: the first LPM_DIRECT_BITS bits
+of the address index a table directly, every node below covers 6 more bits
+with two bitmaps, slots that are child nodes and slots where a run of equal
+leaves starts. Children and leaves of a node are stored contiguously, so the
+popcount of a bitmap up to the slot is the index. A lookup reads the table, a
+node per 6 bits below the longest prefix on its path and one leaf: 4 reads
+for an address inside a /24. A million random IPv4 prefixes take ~16 MB and
+build in about a second, real tables cluster and take less.
+*/
+#define LPM_DIRECT_BITS 16
+#define LPM_LEAF 0x80000000u /* direct entry holds an action, not a node index */
+
+enum { RULE_NONE, RULE_FRAGMENT, RULE_BYPASS, RULE_DENY, RULE_ACTIONS };
+static const char *const rule_names[RULE_ACTIONS] = {"none", "fragment", "bypass", "deny"};
+
+typedef struct {
+    uint64_t key[2]; /* address from the top bit, bits past len are zero */
+    uint32_t line;   /* the later of two equal prefixes wins */
+    uint8_t len;
+    uint8_t action;
+} rule_t;
+
+typedef struct {
+    uint64_t vector;  /* slots that are child nodes */
+    uint64_t leafvec; /* leaf slots whose action differs from the previous leaf slot */
+    uint32_t base0;   /* first leaf */
+    uint32_t base1;   /* first child */
+} lpm_node_t;
+
+typedef struct {
+    uint32_t direct[1 << LPM_DIRECT_BITS];
+    lpm_node_t *nodes;
+    uint8_t *leaves;
+    uint32_t node_count, node_cap, leaf_count, leaf_cap;
+} lpm_t;
+
+static const char *rules_file = NULL;
+static lpm_t *rules_v4 = NULL, *rules_v6 = NULL;
+#ifdef METRICS
+static uint64_t rule_hits[RULE_ACTIONS];
+#endif
+
+/* n bits of key starting at bit off, off < 128 */
+uint32_t lpm_bits(const uint64_t key[2], int off, int n) {
+    uint64_t w = off >= 64 ? key[1] << (off - 64) : off ? key[0] << off | key[1] >> (64 - off) : key[0];
+    return (uint32_t)(w >> (64 - n));
+}
+
+uint8_t lpm_lookup(const lpm_t *t, const uint64_t key[2]) {
+    uint32_t d = t->direct[lpm_bits(key, 0, LPM_DIRECT_BITS)];
+    if (d & LPM_LEAF) return (uint8_t)d;
+    const lpm_node_t *node = &t->nodes[d];
+    int off = LPM_DIRECT_BITS;
+    uint32_t s = lpm_bits(key, off, 6);
+    while (node->vector >> s & 1) {
+        node = &t->nodes[node->base1 + __builtin_popcountll(node->vector & ((2ull << s) - 1)) - 1];
+        off += 6;
+        s = lpm_bits(key, off, 6);
+    }
+    return t->leaves[node->base0 + __builtin_popcountll(node->leafvec & ((2ull << s) - 1)) - 1];
+}
+
+/* slots of a level of 2^bits: the longest of rules [lo, hi) ending in the level, def if none */
+void lpm_slots(const rule_t *r, size_t lo, size_t hi, int off, int bits, uint8_t def, uint8_t *action, uint8_t *len) {
+    size_t slots = (size_t)1 << bits;
+    memset(action, def, slots);
+    memset(len, 0, slots);
+    for (size_t i = lo; i < hi; i++) {
+        if (r[i].len > off + bits) continue;
+        uint32_t first = lpm_bits(r[i].key, off, bits);
+        uint32_t last = first + (1u << (off + bits - r[i].len));
+        for (uint32_t s = first; s < last; s++) {
+            if (r[i].len < len[s]) continue;
+            action[s] = r[i].action;
+            len[s] = r[i].len;
+        }
+    }
+}
+
+/*
+Next slot with rules longer than the level: skips *i to its first rule and
+returns the end of its rules. Sorted rules of one slot are contiguous, a
+shorter rule starting in it sorts before them.
+*/
+size_t lpm_group(const rule_t *r, size_t *i, size_t hi, int off, int bits, uint32_t *slot) {
+    while (*i < hi && r[*i].len <= off + bits) (*i)++;
+    if (*i == hi) return hi;
+    *slot = lpm_bits(r[*i].key, off, bits);
+    size_t j = *i + 1;
+    while (j < hi && r[j].len > off + bits && lpm_bits(r[j].key, off, bits) == *slot) j++;
+    return j;
+}
+
+int lpm_reserve(void **items, uint32_t *cap, uint32_t need, size_t size) {
+    if (need <= *cap) return 0;
+    uint32_t grown = *cap ? *cap : 64;
+    while (grown < need) grown *= 2;
+    void *p = realloc(*items, (size_t)grown * size);
+    if (!p) return -1;
+    *items = p;
+    *cap = grown;
+    return 0;
+}
+
+/* fills the reserved node at, rules [lo, hi) are longer than off and share its path */
+int lpm_node(lpm_t *t, const rule_t *r, size_t lo, size_t hi, int off, uint8_t def, uint32_t at) {
+    uint8_t action[64], len[64];
+    lpm_slots(r, lo, hi, off, 6, def, action, len);
+    uint64_t vector = 0;
+    uint32_t s;
+    for (size_t i = lo, j; (j = lpm_group(r, &i, hi, off, 6, &s)) > i; i = j) vector |= 1ull << s;
+    uint32_t base1 = t->node_count;
+    if (lpm_reserve((void **)&t->nodes, &t->node_cap, base1 + __builtin_popcountll(vector), sizeof(lpm_node_t)) < 0) {
+        return -1;
+    }
+    t->node_count += __builtin_popcountll(vector);
+    uint32_t base0 = t->leaf_count;
+    uint64_t leafvec = 0;
+    int prev = -1;
+    for (s = 0; s < 64; s++) {
+        if (vector >> s & 1 || action[s] == prev) continue;
+        if (lpm_reserve((void **)&t->leaves, &t->leaf_cap, t->leaf_count + 1, 1) < 0) return -1;
+        t->leaves[t->leaf_count++] = action[s];
+        leafvec |= 1ull << s;
+        prev = action[s];
+    }
+    t->nodes[at] = (lpm_node_t){vector, leafvec, base0, base1};
+    uint32_t child = base1;
+    for (size_t i = lo, j; (j = lpm_group(r, &i, hi, off, 6, &s)) > i; i = j) {
+        if (lpm_node(t, r, i, j, off + 6, action[s], child++) < 0) return -1;
+    }
+    return 0;
+}
+
+int rule_compare(const void *a, const void *b) {
+    const rule_t *x = a, *y = b;
+    if (x->key[0] != y->key[0]) return x->key[0] < y->key[0] ? -1 : 1;
+    if (x->key[1] != y->key[1]) return x->key[1] < y->key[1] ? -1 : 1;
+    if (x->len != y->len) return x->len < y->len ? -1 : 1;
+    return x->line < y->line ? -1 : x->line > y->line;
+}
+
+lpm_t *lpm_build(rule_t *r, size_t count) {
+    qsort(r, count, sizeof(*r), rule_compare);
+    lpm_t *t = calloc(1, sizeof(*t));
+    uint8_t *action = malloc(1 << LPM_DIRECT_BITS);
+    uint8_t *len = malloc(1 << LPM_DIRECT_BITS);
+    if (!t || !action || !len) goto fail;
+    lpm_slots(r, 0, count, 0, LPM_DIRECT_BITS, RULE_NONE, action, len);
+    for (uint32_t s = 0; s < 1u << LPM_DIRECT_BITS; s++) t->direct[s] = LPM_LEAF | action[s];
+    uint32_t s;
+    for (size_t i = 0, j; (j = lpm_group(r, &i, count, 0, LPM_DIRECT_BITS, &s)) > i; i = j) {
+        uint32_t at = t->node_count;
+        if (lpm_reserve((void **)&t->nodes, &t->node_cap, at + 1, sizeof(lpm_node_t)) < 0) goto fail;
+        t->node_count++;
+        t->direct[s] = at;
+        if (lpm_node(t, r, i, j, LPM_DIRECT_BITS, action[s], at) < 0) goto fail;
+    }
+    free(action);
+    free(len);
+    return t;
+fail:
+    LOG(LOG_ERR, "rules: out of memory", NULL, 0, 0);
+    if (t) {
+        free(t->nodes);
+        free(t->leaves);
+    }
+    free(t);
+    free(action);
+    free(len);
+    return NULL;
+}
+
+/* "address[/length]" into r, 4 or 6, 0 if invalid */
+int rule_prefix(char *text, rule_t *r) {
+    char *slash = strchr(text, '/');
+    if (slash) *slash = 0;
+    uint8_t addr[16];
+    int family, bits;
+    if (inet_pton(AF_INET, text, addr) == 1) {
+        family = 4;
+        bits = 32;
+    } else if (inet_pton(AF_INET6, text, addr) == 1) {
+        family = 6;
+        bits = 128;
+    } else {
+        return 0;
+    }
+    int len = bits;
+    if (slash) {
+        char *end;
+        long l = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || l < 0 || l > bits) return 0;
+        len = (int)l;
+    }
+    r->key[0] = r->key[1] = 0;
+    for (int i = 0; i < bits / 8; i++) r->key[i / 8] |= (uint64_t)addr[i] << (56 - 8 * (i % 8));
+    if (len < 64) {
+        r->key[0] &= len ? ~0ull << (64 - len) : 0;
+        r->key[1] = 0;
+    } else {
+        r->key[1] &= len > 64 ? ~0ull << (128 - len) : 0;
+    }
+    r->len = (uint8_t)len;
+    return family;
+}
+
+/* startup: parses rules_file and builds both tables, -1 on errors */
+int rules_load(void) {
+    FILE *f = fopen(rules_file, "r");
+    if (!f) {
+        LOG_ERRNO(LOG_ERR, "rules: can't open %s", rules_file, 0, 0);
+        return -1;
+    }
+    rule_t *rules[2] = {NULL, NULL};
+    uint32_t count[2] = {0, 0}, cap[2] = {0, 0};
+    int ret = -1;
+    char line[256];
+    uint32_t line_no = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = 0;
+        char action[16], prefix[64];
+        int fields = sscanf(line, "%15s %63s", action, prefix);
+        if (fields <= 0) continue;
+        rule_t r = {0};
+        for (int a = RULE_FRAGMENT; a < RULE_ACTIONS; a++) {
+            if (strcmp(action, rule_names[a]) == 0) r.action = (uint8_t)a;
+        }
+        int family = fields == 2 && r.action ? rule_prefix(prefix, &r) : 0;
+        if (!family) {
+            LOG(LOG_ERR, "rules: %s line %d is not fragment|bypass|deny address[/length]", rules_file, line_no, 0);
+            goto cleanup;
+        }
+        int v6 = family == 6;
+        r.line = line_no;
+        if (lpm_reserve((void **)&rules[v6], &cap[v6], count[v6] + 1, sizeof(rule_t)) < 0) {
+            LOG(LOG_ERR, "rules: out of memory", NULL, 0, 0);
+            goto cleanup;
+        }
+        rules[v6][count[v6]++] = r;
+    }
+    if (count[0] && !(rules_v4 = lpm_build(rules[0], count[0]))) goto cleanup;
+    if (count[1] && !(rules_v6 = lpm_build(rules[1], count[1]))) goto cleanup;
+    LOG(LOG_INFO, "rules: %s has %u IPv4 and %u IPv6 prefixes", rules_file, count[0], count[1]);
+    LOG(LOG_DEBUG, "rules: %u nodes, %u leaves", NULL, (rules_v4 ? rules_v4->node_count : 0) + (rules_v6 ? rules_v6->node_count : 0),
+        (rules_v4 ? rules_v4->leaf_count : 0) + (rules_v6 ? rules_v6->leaf_count : 0));
+    ret = 0;
+cleanup:
+    fclose(f);
+    free(rules[0]);
+    free(rules[1]);
+    return ret;
+}
+
+int rule_match(const struct sockaddr *sa) {
+    uint64_t key[2] = {0, 0};
+    const lpm_t *t;
+    if (sa->sa_family == AF_INET) {
+        key[0] = (uint64_t)ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr) << 32;
+        t = rules_v4;
+    } else if (sa->sa_family == AF_INET6) {
+        const struct in6_addr *in6 = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+        const uint8_t *a = in6->s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(in6)) {
+            key[0] = (uint64_t)((uint32_t)a[12] << 24 | a[13] << 16 | a[14] << 8 | a[15]) << 32;
+            t = rules_v4;
+        } else {
+            for (int i = 0; i < 16; i++) key[i / 8] |= (uint64_t)a[i] << (56 - 8 * (i % 8));
+            t = rules_v6;
+        }
+    } else {
+        return RULE_NONE;
+    }
+    return t ? lpm_lookup(t, key) : RULE_NONE;
+}
+
+/* connect loops skip denied addresses */
+int rule_denied(const char *host, const struct sockaddr *sa) {
+    if (rule_match(sa) != RULE_DENY) return 0;
+#ifdef METRICS
+    __atomic_add_fetch(&rule_hits[RULE_DENY], 1, __ATOMIC_RELAXED);
+#endif
+    LOG(LOG_INFO, "rules: an address of %s is denied", host, 0, 0);
+    return 1;
+}
+
+#ifdef METRICS
+void rule_metrics(FILE *out) {
+    fprintf(out, "# TYPE proxy_rule_hits_total counter\n");
+    for (int a = RULE_FRAGMENT; a < RULE_ACTIONS; a++) {
+        fprintf(out, "proxy_rule_hits_total{action=\"%s\"} %llu\n", rule_names[a],
+                (unsigned long long)__atomic_load_n(&rule_hits[a], __ATOMIC_RELAXED));
+    }
+}
+#endif
+#endif
+
+#ifdef WARM_CACHE
+/*
+Warm cache. -w file is mapped shared at startup and updated in place, so a
+restart (or hot upgrade) begins with what the previous run knew: resolved
+addresses of hosts (getaddrinfo gives no TTL, they are kept WARM_DNS_TTL
+seconds), the address that connected last goes first, a moving average of
+connect time and the ADAPTIVE_FRAGMENT state of the host. The file has a fixed
+size (header and WARM_CACHE_SLOTS records) and is never grown. Every record
+carries a checksum written after its fields. A record torn by power loss fails
+the check at startup and is dropped. Files of another version, record size,
+slot count or byte order are started over. The kernel writes dirty pages back
+on its own schedule, so flash sees at most one write per page per writeback
+interval.
+*/
+#define WARM_MAGIC "PXWC"
+#define WARM_VERSION 2 /* 2: 64 bit FNV-1a for slots and checksums */
+#define WARM_ADDRS 4
+#define WARM_PROBE 8
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order; /* 0x01020304 as written by this machine */
+    uint32_t record_size;
+    uint32_t slots;
+    uint32_t reserved[3];
+} warm_header_t;
+
+typedef struct {
+    uint32_t checksum;   /* of the rest of the record, 0 - free slot */
+    uint8_t strategy;    /* ADAPTIVE_FRAGMENT state, valid until strategy_expires */
+    uint8_t floor;
+    uint8_t addr_count;
+    uint8_t reserved;
+    uint32_t connect_us; /* moving average over the last connects */
+    int64_t dns_expires;
+    int64_t strategy_expires;
+    int64_t used;        /* last update, the oldest record is replaced */
+    uint8_t families[WARM_ADDRS];
+    uint8_t addrs[WARM_ADDRS][16];
+    char host[256];
+} warm_record_t;
+
+static const char *warm_file = NULL;
+static warm_record_t *warm_records = NULL;
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t warm_checksum(const warm_record_t *r) {
+    uint64_t x = fnv1a((const uint8_t *)r + sizeof(r->checksum), sizeof(*r) - sizeof(r->checksum), FNV1A_SEED);
+    uint32_t h = (uint32_t)(x ^ (x >> 32));
+    return h ? h : 1;
+}
+
+/* after the fields, a record torn before this point fails the check */
+void warm_seal(warm_record_t *r) {
+    r->used = time(NULL);
+    r->checksum = warm_checksum(r);
+}
+
+/* caller holds warm_lock */
+warm_record_t *warm_slot(const char *host, int create) {
+    uint64_t h = host_hash(host, FNV1A_SEED);
+    warm_record_t *victim = NULL;
+    for (int i = 0; i < WARM_PROBE; i++) {
+        warm_record_t *r = &warm_records[(h + i) % WARM_CACHE_SLOTS];
+        if (r->checksum && strcasecmp(r->host, host) == 0) return r;
+        if (!create) continue;
+        if (!r->checksum) {
+            if (!victim || victim->checksum) victim = r;
+        } else if (!victim || (victim->checksum && r->used < victim->used)) {
+            victim = r;
+        }
+    }
+    if (!create) return NULL;
+    memset(victim, 0, sizeof(*victim));
+    snprintf(victim->host, sizeof(victim->host), "%s", host);
+    return victim;
+}
+
+int ip_literal(const char *host) {
+    uint8_t addr[16];
+    return inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1;
+}
+
+/* startup, before any thread: checks or creates the file, restores strategies */
+void warm_open(void) {
+    size_t size = sizeof(warm_header_t) + (size_t)WARM_CACHE_SLOTS * sizeof(warm_record_t);
+    int fd = open(warm_file, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERRNO(LOG_WARNING, "warm cache: can't open %s", warm_file, 0, 0);
+        return;
+    }
+    warm_header_t hdr = {0};
+    struct stat st;
+    int fresh = fstat(fd, &st) < 0 || st.st_size != (off_t)size || read_n(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+                memcmp(hdr.magic, WARM_MAGIC, 4) != 0 || hdr.version != WARM_VERSION || hdr.byte_order != 0x01020304 ||
+                hdr.record_size != sizeof(warm_record_t) || hdr.slots != WARM_CACHE_SLOTS;
+    if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)size) < 0)) {
+        LOG_ERRNO(LOG_WARNING, "warm cache: can't size %s", warm_file, 0, 0);
+        close(fd);
+        return;
+    }
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERRNO(LOG_WARNING, "warm cache: can't map %s", warm_file, 0, 0);
+        return;
+    }
+    warm_records = (warm_record_t *)(map + sizeof(warm_header_t));
+    if (fresh) {
+        memcpy(hdr.magic, WARM_MAGIC, 4);
+        hdr.version = WARM_VERSION;
+        hdr.byte_order = 0x01020304;
+        hdr.record_size = sizeof(warm_record_t);
+        hdr.slots = WARM_CACHE_SLOTS;
+        memcpy(map, &hdr, sizeof(hdr));
+        LOG(LOG_INFO, "warm cache: starting %s empty", warm_file, 0, 0);
+        return;
+    }
+    int hosts = 0, torn = 0;
+    time_t now = time(NULL);
+    for (int i = 0; i < WARM_CACHE_SLOTS; i++) {
+        warm_record_t *r = &warm_records[i];
+        if (!r->checksum) continue;
+        if (r->checksum != warm_checksum(r) || memchr(r->host, 0, sizeof(r->host)) == NULL) {
+            memset(r, 0, sizeof(*r));
+            torn++;
+            continue;
+        }
+        hosts++;
+#ifdef ADAPTIVE_FRAGMENT
+        if (r->strategy_expires > now && r->strategy < FRAG_STRATEGY_COUNT && r->floor <= r->strategy) {
+            strategy_entry_t *e = strategy_slot(r->host, 1, now);
+            e->strategy = r->strategy;
+            e->floor = r->floor;
+            e->expires = (time_t)r->strategy_expires;
+        }
+#else
+        (void)now;
+#endif
+    }
+    LOG(LOG_INFO, "warm cache: %d hosts, %d torn records dropped", warm_file, hosts, torn);
+}
+
+#ifdef ADAPTIVE_FRAGMENT
+void warm_put_strategy(const char *host, int strategy, int floor, time_t expires) {
+    if (!warm_records) return;
+    pthread_mutex_lock(&warm_lock);
+    warm_record_t *r = warm_slot(host, 1);
+    r->strategy = (uint8_t)strategy;
+    r->floor = (uint8_t)floor;
+    r->strategy_expires = expires;
+    warm_seal(r);
+    pthread_mutex_unlock(&warm_lock);
+}
+#endif
+
+/* caller holds warm_lock */
+void warm_add_addr(warm_record_t *r, const struct addrinfo *rp) {
+    uint8_t addr[16] = {0};
+    if (rp->ai_family == AF_INET) {
+        memcpy(addr, &((const struct sockaddr_in *)rp->ai_addr)->sin_addr, 4);
+    } else if (rp->ai_family == AF_INET6) {
+        memcpy(addr, &((const struct sockaddr_in6 *)rp->ai_addr)->sin6_addr, 16);
+    } else {
+        return;
+    }
+    if (r->addr_count == WARM_ADDRS) return;
+    for (int i = 0; i < r->addr_count; i++) {
+        if (r->families[i] == rp->ai_family && memcmp(r->addrs[i], addr, 16) == 0) return;
+    }
+    r->families[r->addr_count] = (uint8_t)rp->ai_family;
+    memcpy(r->addrs[r->addr_count++], addr, 16);
+}
+
+/* a fresh getaddrinfo answer, connected is the address that worked */
+void warm_put_addrs(const char *host, const struct addrinfo *res, const struct addrinfo *connected, int64_t connect_ns) {
+    if (!warm_records || ip_literal(host)) return;
+    pthread_mutex_lock(&warm_lock);
+    warm_record_t *r = warm_slot(host, 1);
+    r->addr_count = 0;
+    warm_add_addr(r, connected);
+    for (const struct addrinfo *rp = res; rp; rp = rp->ai_next) warm_add_addr(r, rp);
+    r->dns_expires = time(NULL) + WARM_DNS_TTL;
+    uint32_t us = (uint32_t)(connect_ns / 1000);
+    r->connect_us = r->connect_us ? (r->connect_us * 7 + us) / 8 : us;
+    warm_seal(r);
+    pthread_mutex_unlock(&warm_lock);
+}
+
+/* cached addresses warm_connect dialed without success */
+typedef struct {
+    int count;
+    uint8_t families[WARM_ADDRS];
+    uint8_t addrs[WARM_ADDRS][16];
+} warm_dialed_t;
+
+int warm_dialed_has(const warm_dialed_t *d, const struct sockaddr *sa) {
+    for (int i = 0; i < d->count; i++) {
+        if (d->families[i] != sa->sa_family) continue;
+        if (sa->sa_family == AF_INET && memcmp(d->addrs[i], &((const struct sockaddr_in *)sa)->sin_addr, 4) == 0) return 1;
+        if (sa->sa_family == AF_INET6 && memcmp(d->addrs[i], &((const struct sockaddr_in6 *)sa)->sin6_addr, 16) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+Connects to cached addresses of host. -1 with dialed->count > 0 if some were
+dialed and none worked (errno of the last one, the record is marked stale so
+the next connect resolves again), -1 with dialed->count 0 if there was
+nothing to dial.
+*/
+int warm_connect(const char *host, const char *port, warm_dialed_t *dialed) {
+    dialed->count = 0;
+    if (!warm_records || ip_literal(host)) return -1;
+    uint8_t families[WARM_ADDRS];
+    uint8_t addrs[WARM_ADDRS][16];
+    int count = 0;
+    pthread_mutex_lock(&warm_lock);
+    warm_record_t *r = warm_slot(host, 0);
+    if (r && r->dns_expires > time(NULL)) {
+        count = r->addr_count < WARM_ADDRS ? r->addr_count : WARM_ADDRS;
+        memcpy(families, r->families, sizeof(families));
+        memcpy(addrs, r->addrs, sizeof(addrs));
+    }
+    pthread_mutex_unlock(&warm_lock);
+    uint16_t port_be = htons((uint16_t)atoi(port));
+    int err = 0;
+    for (int i = 0; i < count; i++) {
+        struct sockaddr_storage sa = {0};
+        socklen_t len;
+        if (families[i] == AF_INET) {
+            struct sockaddr_in *in = (struct sockaddr_in *)&sa;
+            in->sin_family = AF_INET;
+            in->sin_port = port_be;
+            memcpy(&in->sin_addr, addrs[i], 4);
+            len = sizeof(*in);
+        } else if (families[i] == AF_INET6) {
+            struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&sa;
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = port_be;
+            memcpy(&in6->sin6_addr, addrs[i], 16);
+            len = sizeof(*in6);
+        } else {
+            continue;
+        }
+#ifdef CIDR_RULES
+        if (rule_denied(host, (struct sockaddr *)&sa)) continue;
+#endif
+        int sock = socket(families[i], SOCK_STREAM, 0);
+        if (sock < 0) continue;
+        dialed->families[dialed->count] = families[i];
+        memcpy(dialed->addrs[dialed->count++], addrs[i], 16);
+        int64_t started = now_ns();
+        if (connect_timeout(sock, (struct sockaddr *)&sa, len) == 0) {
+            uint32_t us = (uint32_t)((now_ns() - started) / 1000);
+            pthread_mutex_lock(&warm_lock);
+            r = warm_slot(host, 0);
+            if (r) {
+                /* the working address goes first */
+                if (i > 0 && i < r->addr_count && r->families[i] == families[i] && memcmp(r->addrs[i], addrs[i], 16) == 0) {
+                    memmove(r->families + 1, r->families, i);
+                    memmove(r->addrs[1], r->addrs[0], (size_t)i * 16);
+                    r->families[0] = families[i];
+                    memcpy(r->addrs[0], addrs[i], 16);
+                }
+                r->connect_us = r->connect_us ? (r->connect_us * 7 + us) / 8 : us;
+                warm_seal(r);
+            }
+            pthread_mutex_unlock(&warm_lock);
+            return sock;
+        }
+        err = errno;
+        close(sock);
+    }
+    if (dialed->count) {
+        /* addresses are stale, the next connect resolves again */
+        pthread_mutex_lock(&warm_lock);
+        r = warm_slot(host, 0);
+        if (r) {
+            r->dns_expires = 0;
+            warm_seal(r);
+        }
+        pthread_mutex_unlock(&warm_lock);
+        LOG(LOG_DEBUG, "warm cache: cached addresses of %s failed", host, 0, 0);
+        errno = err;
+    }
+    return -1;
+}
+#endif
+
+/* on failure errno is ETIMEDOUT for timeouts, EACCES if CIDR_RULES denied every address */
+int connect_dial(const char *host, const char *port) {
+    struct addrinfo hints = {0}, *res, *rp;
+    int sock = -1;
+#ifdef WARM_CACHE
+    warm_dialed_t dialed;
+    if ((sock = warm_connect(host, port, &dialed)) >= 0) return sock;
+    int warm_err = errno;
+    /* a timeout means the host is down rather than moved, resolving again would make the client wait twice */
+    if (dialed.count && warm_err == ETIMEDOUT) return -1;
+#endif
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        LOG(LOG_INFO, "getaddrinfo: can't resolve %s (error %d)", host, err, 0);
+        errno = err == EAI_AGAIN ? ETIMEDOUT : EHOSTUNREACH;
+        return -1;
+    }
+    err = EACCES;
+#ifdef WARM_CACHE
+    if (dialed.count) err = warm_err;
+#endif
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+#ifdef CIDR_RULES
+        if (rule_denied(host, rp->ai_addr)) continue;
+#endif
+#ifdef WARM_CACHE
+        if (warm_dialed_has(&dialed, rp->ai_addr)) continue; /* failed a moment ago */
+#endif
+        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sock == -1) {
+            err = errno;
+            continue;
+        }
+#ifdef WARM_CACHE
+        int64_t started = now_ns();
+        if (connect_timeout(sock, rp->ai_addr, rp->ai_addrlen) == 0) {
+            warm_put_addrs(host, res, rp, now_ns() - started);
+            break;
+        }
+#else
+        if (connect_timeout(sock, rp->ai_addr, rp->ai_addrlen) == 0) break;
+#endif
+        err = errno;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock < 0) errno = err;
+    return sock;
+}
+
+int connect_remote(const char *host, const char *port) {
+#ifdef CIRCUIT_BREAKER
+    if (breaker_check(host, port) < 0) return -1;
+    int sock = connect_dial(host, port);
+    int err = errno;
+    breaker_report(host, port, sock >= 0 ? 1 : err == EACCES ? 0 : -1, err);
+    errno = err;
+    return sock;
+#else
+    return connect_dial(host, port);
+#endif
+}
+
+#ifdef UDP_RELAY
+/*
+QUIC Initial packets are encrypted with keys anyone can derive from the
+destination connection id (RFC 9001 section 5.2), so the relay can decrypt the
+first Initial, put the second half of the ClientHello (from the middle of SNI)
+in a CRYPTO frame before the first half and encrypt it again. The packet keeps
+its size and packet number, only frames that were padding are used.
+Primitives below are the minimum for that: SHA-256, HKDF, AES-128, GCM.
+*/
+static int quic_reorder = 0;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_block(uint32_t h[8], const uint8_t *p) {
+    uint32_t w[64], s[8];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    memcpy(s, h, sizeof(s));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = s[7] + (ROR32(s[4], 6) ^ ROR32(s[4], 11) ^ ROR32(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(s[0], 2) ^ ROR32(s[0], 13) ^ ROR32(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) h[i] += s[i];
+}
+
+/* message is at most a few hundred bytes here, hashed from one buffer */
+void sha256(const uint8_t *data, size_t len, uint8_t out[32]) {
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t last[128] = {0};
+    size_t full = len & ~(size_t)63;
+    for (size_t i = 0; i < full; i += 64) sha256_block(h, data + i);
+    size_t rest = len - full;
+    memcpy(last, data + full, rest);
+    last[rest] = 0x80;
+    size_t blocks = rest + 9 > 64 ? 2 : 1;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) last[blocks * 64 - 1 - i] = (uint8_t)(bits >> (8 * i));
+    for (size_t i = 0; i < blocks; i++) sha256_block(h, last + 64 * i);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = h[i] >> 24;
+        out[4 * i + 1] = h[i] >> 16;
+        out[4 * i + 2] = h[i] >> 8;
+        out[4 * i + 3] = h[i];
+    }
+}
+
+/* key up to 64 bytes, data up to 128 */
+void hmac_sha256(const uint8_t *key, size_t key_len, const uint8_t *data, size_t data_len, uint8_t out[32]) {
+    uint8_t buf[64 + 128];
+    uint8_t inner[64 + 32];
+    for (int i = 0; i < 64; i++) {
+        uint8_t k = (size_t)i < key_len ? key[i] : 0;
+        buf[i] = k ^ 0x36;
+        inner[i] = k ^ 0x5c;
+    }
+    memcpy(buf + 64, data, data_len);
+    sha256(buf, 64 + data_len, inner + 64);
+    sha256(inner, sizeof(inner), out);
+}
+
+/* TLS 1.3 HKDF-Expand-Label with empty context, out_len <= 32 */
+void hkdf_expand_label(const uint8_t secret[32], const char *label, uint8_t *out, size_t out_len) {
+    uint8_t info[64];
+    size_t label_len = strlen(label);
+    info[0] = 0;
+    info[1] = (uint8_t)out_len;
+    info[2] = (uint8_t)(6 + label_len);
+    memcpy(info + 3, "tls13 ", 6);
+    memcpy(info + 9, label, label_len);
+    info[9 + label_len] = 0;
+    info[10 + label_len] = 1;
+    uint8_t t[32];
+    hmac_sha256(secret, 32, info, 11 + label_len, t);
+    memcpy(out, t, out_len);
+}
+
+static const uint8_t aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+#define XTIME(x) ((uint8_t)(((x) << 1) ^ (((x) >> 7) * 0x1b)))
+
+void aes128_expand(const uint8_t key[16], uint8_t rk[176]) {
+    uint8_t rcon = 1;
+    memcpy(rk, key, 16);
+    for (int i = 16; i < 176; i += 4) {
+        uint8_t t[4] = {rk[i - 4], rk[i - 3], rk[i - 2], rk[i - 1]};
+        if (i % 16 == 0) {
+            uint8_t first = t[0];
+            t[0] = aes_sbox[t[1]] ^ rcon;
+            t[1] = aes_sbox[t[2]];
+            t[2] = aes_sbox[t[3]];
+            t[3] = aes_sbox[first];
+            rcon = XTIME(rcon);
+        }
+        for (int j = 0; j < 4; j++) rk[i + j] = rk[i - 16 + j] ^ t[j];
+    }
+}
+
+void aes128_encrypt(const uint8_t rk[176], const uint8_t in[16], uint8_t out[16]) {
+    uint8_t s[16];
+    for (int i = 0; i < 16; i++) s[i] = in[i] ^ rk[i];
+    for (int round = 1; round <= 10; round++) {
+        uint8_t t[16];
+        /* SubBytes and ShiftRows, state is column major */
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) t[4 * c + r] = aes_sbox[s[4 * ((c + r) % 4) + r]];
+        }
+        if (round < 10) {
+            for (int c = 0; c < 4; c++) {
+                uint8_t *col = t + 4 * c;
+                uint8_t all = col[0] ^ col[1] ^ col[2] ^ col[3];
+                uint8_t first = col[0];
+                col[0] ^= all ^ XTIME(col[0] ^ col[1]);
+                col[1] ^= all ^ XTIME(col[1] ^ col[2]);
+                col[2] ^= all ^ XTIME(col[2] ^ col[3]);
+                col[3] ^= all ^ XTIME(col[3] ^ first);
+            }
+        }
+        for (int i = 0; i < 16; i++) s[i] = t[i] ^ rk[16 * round + i];
+    }
+    memcpy(out, s, 16);
+}
+
+/* x = x * h in GF(2^128) */
+void gcm_mul(uint8_t x[16], const uint8_t h[16]) {
+    uint8_t z[16] = {0};
+    uint8_t v[16];
+    memcpy(v, h, 16);
+    for (int i = 0; i < 128; i++) {
+        if (x[i / 8] & (0x80 >> (i % 8))) {
+            for (int j = 0; j < 16; j++) z[j] ^= v[j];
+        }
+        int lsb = v[15] & 1;
+        for (int j = 15; j > 0; j--) v[j] = (uint8_t)((v[j] >> 1) | (v[j - 1] << 7));
+        v[0] >>= 1;
+        if (lsb) v[0] ^= 0xe1;
+    }
+    memcpy(x, z, 16);
+}
+
+void gcm_ghash(uint8_t y[16], const uint8_t h[16], const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i += 16) {
+        for (size_t j = 0; j < 16 && i + j < len; j++) y[j] ^= data[i + j];
+        gcm_mul(y, h);
+    }
+}
+
+/* AES-128-GCM with 12 byte nonce, in and out may be the same buffer */
+void aes128_gcm(const uint8_t rk[176], const uint8_t iv[12], const uint8_t *aad, size_t aad_len,
+                const uint8_t *in, uint8_t *out, size_t len, uint8_t tag[16], int encrypt) {
+    uint8_t h[16] = {0};
+    uint8_t y[16] = {0};
+    uint8_t ctr[16];
+    uint8_t block[16];
+    aes128_encrypt(rk, h, h);
+    gcm_ghash(y, h, aad, aad_len);
+    if (!encrypt) gcm_ghash(y, h, in, len);
+    memcpy(ctr, iv, 12);
+    for (size_t i = 0; i < len; i += 16) {
+        uint32_t n = (uint32_t)(i / 16) + 2;
+        ctr[12] = n >> 24;
+        ctr[13] = n >> 16;
+        ctr[14] = n >> 8;
+        ctr[15] = n;
+        aes128_encrypt(rk, ctr, block);
+        for (size_t j = 0; j < 16 && i + j < len; j++) out[i + j] = in[i + j] ^ block[j];
+    }
+    if (encrypt) gcm_ghash(y, h, out, len);
+    uint8_t lens[16];
+    uint64_t bits[2] = {(uint64_t)aad_len * 8, (uint64_t)len * 8};
+    for (int i = 0; i < 8; i++) {
+        lens[7 - i] = (uint8_t)(bits[0] >> (8 * i));
+        lens[15 - i] = (uint8_t)(bits[1] >> (8 * i));
+    }
+    gcm_ghash(y, h, lens, 16);
+    ctr[12] = ctr[13] = ctr[14] = 0;
+    ctr[15] = 1;
+    aes128_encrypt(rk, ctr, block);
+    for (int i = 0; i < 16; i++) tag[i] = y[i] ^ block[i];
+}
+
+int quic_varint(const uint8_t *p, size_t len, size_t *pos, uint64_t *v) {
+    if (*pos >= len) return 0;
+    size_t n = (size_t)1 << (p[*pos] >> 6);
+    if (*pos + n > len) return 0;
+    *v = p[*pos] & 0x3f;
+    for (size_t i = 1; i < n; i++) *v = (*v << 8) | p[*pos + i];
+    *pos += n;
+    return 1;
+}
+
+/* reorders CRYPTO data of a QUIC v1 client Initial in place, 0 if done */
+int quic_reorder_initial(uint8_t *pkt, size_t len) {
+    static const uint8_t salt[20] = {
+        0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+        0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a
+    };
+    size_t pos = 5;
+    uint64_t token_len, length;
+    if (len < 7 || (pkt[0] & 0xf0) != 0xc0 || memcmp(pkt + 1, "\x00\x00\x00\x01", 4) != 0) return -1;
+    size_t dcid_pos = 6;
+    size_t dcid_len = pkt[5];
+    pos += 1 + dcid_len;
+    if (dcid_len > 20 || pos >= len) return -1;
+    pos += 1 + pkt[pos];
+    if (!quic_varint(pkt, len, &pos, &token_len) || token_len > len - pos) return -1;
+    pos += token_len;
+    if (!quic_varint(pkt, len, &pos, &length) || length > len - pos || length < 4 + 16 + 16) return -1;
+    size_t pn_pos = pos;
+
+    uint8_t secret[32], client_secret[32], key[16], iv[12], hp[16];
+    hmac_sha256(salt, sizeof(salt), pkt + dcid_pos, dcid_len, secret);
+    hkdf_expand_label(secret, "client in", client_secret, 32);
+    hkdf_expand_label(client_secret, "quic key", key, 16);
+    hkdf_expand_label(client_secret, "quic iv", iv, 12);
+    hkdf_expand_label(client_secret, "quic hp", hp, 16);
+    uint8_t rk[176], hp_rk[176], mask[16];
+    aes128_expand(key, rk);
+    aes128_expand(hp, hp_rk);
+    aes128_encrypt(hp_rk, pkt + pn_pos + 4, mask);
+
+    uint8_t header[UDP_SLOT];
+    uint8_t first = pkt[0] ^ (mask[0] & 0x0f);
+    size_t pn_len = (first & 3) + 1;
+    size_t header_len = pn_pos + pn_len;
+    memcpy(header, pkt, header_len);
+    header[0] = first;
+    uint8_t nonce[12];
+    memcpy(nonce, iv, 12);
+    for (size_t i = 0; i < pn_len; i++) {
+        header[pn_pos + i] ^= mask[1 + i];
+        nonce[12 - pn_len + i] ^= header[pn_pos + i];
+    }
+    uint8_t *payload = pkt + header_len;
+    size_t payload_len = length - pn_len - 16;
+    uint8_t plain[UDP_SLOT], tag[16];
+    aes128_gcm(rk, nonce, header, header_len, payload, plain, payload_len, tag, 0);
+    if (memcmp(tag, payload + payload_len, 16) != 0) return -1;
+
+    /*
+    CRYPTO frames in any number and order (Chrome shuffles pieces of the
+    ClientHello) with padding or ping between them. Together they must cover
+    0..end without gaps, so a ClientHello that continues in a second Initial
+    packet is left alone.
+    */
+    uint8_t data[UDP_SLOT], covered[UDP_SLOT] = {0};
+    size_t data_len = 0;
+    int crypto_frames = 0;
+    for (size_t i = 0; i < payload_len;) {
+        if (plain[i] == 0x00 || plain[i] == 0x01) {
+            i++;
+        } else if (plain[i] == 0x06) {
+            uint64_t offset, frame_len;
+            i++;
+            if (!quic_varint(plain, payload_len, &i, &offset) || !quic_varint(plain, payload_len, &i, &frame_len)) return -1;
+            if (frame_len > payload_len - i || offset > sizeof(data) - frame_len) return -1;
+            memcpy(data + offset, plain + i, frame_len);
+            memset(covered + offset, 1, frame_len);
+            if (offset + frame_len > data_len) data_len = offset + frame_len;
+            crypto_frames++;
+            i += frame_len;
+        } else {
+            return -1;
+        }
+    }
+    size_t sni_start, sni_end;
+    if (!crypto_frames || memchr(covered, 0, data_len) || data_len >= 16384 || payload_len < data_len + 9) return -1;
+    if (!find_sni(data, data_len, &sni_start, &sni_end)) return -1;
+    size_t split = sni_start + (sni_end - sni_start) / 2;
+
+    uint8_t frames[UDP_SLOT] = {0};
+    size_t n = 0;
+    frames[n++] = 0x06;
+    frames[n++] = 0x40 | (uint8_t)(split >> 8);
+    frames[n++] = (uint8_t)split;
+    frames[n++] = 0x40 | (uint8_t)((data_len - split) >> 8);
+    frames[n++] = (uint8_t)(data_len - split);
+    memcpy(frames + n, data + split, data_len - split);
+    n += data_len - split;
+    frames[n++] = 0x06;
+    frames[n++] = 0x00;
+    frames[n++] = 0x40 | (uint8_t)(split >> 8);
+    frames[n++] = (uint8_t)split;
+    memcpy(frames + n, data, split);
+
+    aes128_gcm(rk, nonce, header, header_len, frames, payload, payload_len, payload + payload_len, 1);
+    aes128_encrypt(hp_rk, pkt + pn_pos + 4, mask);
+    pkt[0] = first ^ (mask[0] & 0x0f);
+    for (size_t i = 0; i < pn_len; i++) pkt[pn_pos + i] = header[pn_pos + i] ^ mask[1 + i];
+    return 0;
+}
+
+/*
+SOCKS5 (RFC 1928) without authentication, recognized by the first byte on the
+proxy port. CONNECT continues as a normal tunnel, UDP ASSOCIATE is relayed by
+the handle_client thread until the TCP connection closes. Every destination
+gets its own connected upstream socket (NAT entry), least recently used one is
+replaced when the table is full and idle ones expire. Datagrams are read and
+written in batches, a batch of same size datagrams for one destination goes
+out as one UDP GSO send and upstream sockets ask for GRO. getaddrinfo for a
+domain destination runs in its own thread, which writes the result to a pipe
+of the association, so a slow lookup never holds the relay loop.
+*/
+#define SOCKS5_VERSION 5
+
+enum { SOCKS5_OK = 0, SOCKS5_FAIL = 1, SOCKS5_UNREACHABLE = 4, SOCKS5_BAD_COMMAND = 7, SOCKS5_BAD_ADDRESS = 8 };
+
+typedef struct {
+    int fd;                /* connected upstream socket, -1 - free */
+    int gro;
+    int64_t last_ns;
+    uint8_t key[1 + 1 + 255 + 2]; /* destination as in the request: type, address, port */
+    size_t key_len;
+    uint8_t reply[3 + 1 + 16 + 2]; /* header of datagrams to client */
+    size_t reply_len;
+} udp_flow_t;
+
+enum { UDP_NAME_FREE = 0, UDP_NAME_PENDING, UDP_NAME_OK, UDP_NAME_FAILED };
+
+/* domain destination, also the message a lookup thread writes to the association pipe */
+typedef struct {
+    uint8_t key[1 + 1 + 255 + 2];
+    size_t key_len;
+    int state;
+    struct sockaddr_storage addr;
+    int64_t expires_ns;
+} udp_name_t;
+
+typedef struct {
+    int fd; /* own copy of the write end of the association pipe */
+    udp_name_t name;
+} udp_lookup_t;
+
+typedef struct {
+    int tcp_fd;
+    int udp_fd;
+    struct sockaddr_storage client;
+    socklen_t client_len;
+    int client_port_known;
+    uint64_t up;
+    uint64_t down;
+    udp_flow_t flows[UDP_MAX_FLOWS];
+    udp_name_t names[UDP_MAX_FLOWS];
+    int names_pipe[2]; /* lookup results, read end is non-blocking */
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct mmsghdr out_msgs[UDP_BATCH];
+    struct iovec out_iovs[UDP_BATCH];
+    uint8_t *bufs[UDP_BATCH];
+    size_t lens[UDP_BATCH];
+    uint8_t rx[UDP_BATCH * UDP_SLOT];
+    uint8_t tx[UDP_BATCH * UDP_SLOT];
+    uint8_t gso[UDP_BATCH * UDP_SLOT];
+} udp_assoc_t;
+
+static int udp_gso = 1;
+
+/* type, address and port as in SOCKS5 header */
+size_t socks5_put_addr(uint8_t *out, const struct sockaddr_storage *sa) {
+    if (sa->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)sa;
+        out[0] = 4;
+        memcpy(out + 1, &in6->sin6_addr, 16);
+        memcpy(out + 17, &in6->sin6_port, 2);
+        return 19;
+    }
+    const struct sockaddr_in *in = (const struct sockaddr_in *)sa;
+    out[0] = 1;
+    memcpy(out + 1, &in->sin_addr, 4);
+    memcpy(out + 5, &in->sin_port, 2);
+    return 7;
+}
+
+/* length of type, address and port at p, 0 if bad */
+size_t socks5_addr_len(const uint8_t *p, size_t len) {
+    if (len < 1) return 0;
+    size_t n = p[0] == 1 ? 1 + 4 + 2 : p[0] == 4 ? 1 + 16 + 2 : p[0] == 3 && len > 1 ? 2 + (size_t)p[1] + 2 : 0;
+    return n <= len ? n : 0;
+}
+
+/* IPv4 or IPv6 address at p to sockaddr, -1 for a domain */
+int socks5_sockaddr(const uint8_t *p, struct sockaddr_storage *sa, socklen_t *sa_len) {
+    memset(sa, 0, sizeof(*sa));
+    if (p[0] == 1) {
+        struct sockaddr_in *in = (struct sockaddr_in *)sa;
+        in->sin_family = AF_INET;
+        memcpy(&in->sin_addr, p + 1, 4);
+        memcpy(&in->sin_port, p + 5, 2);
+        *sa_len = sizeof(*in);
+        return 0;
+    }
+    if (p[0] == 4) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)sa;
+        in6->sin6_family = AF_INET6;
+        memcpy(&in6->sin6_addr, p + 1, 16);
+        memcpy(&in6->sin6_port, p + 17, 2);
+        *sa_len = sizeof(*in6);
+        return 0;
+    }
+    return -1;
+}
+
+/* address at p to host and port strings */
+int socks5_get_addr(const uint8_t *p, char *host, size_t host_size, char port[8]) {
+    size_t n = 1;
+    if (p[0] == 1) {
+        inet_ntop(AF_INET, p + 1, host, host_size);
+        n += 4;
+    } else if (p[0] == 4) {
+        inet_ntop(AF_INET6, p + 1, host, host_size);
+        n += 16;
+    } else if (p[0] == 3) {
+        if (p[1] == 0 || (size_t)p[1] >= host_size) return -1;
+        memcpy(host, p + 2, p[1]);
+        host[p[1]] = 0;
+        n += 1 + p[1];
+    } else {
+        return -1;
+    }
+    snprintf(port, 8, "%u", (unsigned)p[n] << 8 | p[n + 1]);
+    return 0;
+}
+
+int socks5_reply(int fd, int code, const struct sockaddr_storage *bound) {
+    uint8_t reply[3 + 19] = {SOCKS5_VERSION, (uint8_t)code, 0};
+    struct sockaddr_storage none = {0};
+    none.ss_family = AF_INET;
+    size_t n = 3 + socks5_put_addr(reply + 3, bound ? bound : &none);
+    return write_n(fd, reply, n) == (ssize_t)n ? 0 : -1;
+}
+
+int same_ip(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) return 0;
+    if (a->ss_family == AF_INET) {
+        return ((const struct sockaddr_in *)a)->sin_addr.s_addr == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+    }
+    return a->ss_family == AF_INET6 &&
+        memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr, 16) == 0;
+}
+
+void udp_flow_close(udp_flow_t *f) {
+    close(f->fd);
+    f->fd = -1;
+}
+
+void *udp_lookup_thread(void *arg) {
+    udp_lookup_t *l = (udp_lookup_t *)arg;
+    char host[256] = "", port[8];
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    l->name.state = UDP_NAME_FAILED;
+    if (socks5_get_addr(l->name.key, host, sizeof(host), port) == 0 && getaddrinfo(host, port, &hints, &res) == 0) {
+        memcpy(&l->name.addr, res->ai_addr, res->ai_addrlen);
+        l->name.state = UDP_NAME_OK;
+        freeaddrinfo(res);
+    } else {
+        LOG(LOG_INFO, "udp: can't resolve %s", host, 0, 0);
+    }
+    /* smaller than PIPE_BUF, so written at once; EPIPE if the association is gone */
+    write_n(l->fd, &l->name, sizeof(l->name));
+    close(l->fd);
+    free(l);
+    return NULL;
+}
+
+/* results of lookup threads */
+void udp_names_read(udp_assoc_t *a, int64_t now) {
+    udp_name_t result;
+    while (read(a->names_pipe[0], &result, sizeof(result)) == (ssize_t)sizeof(result)) {
+        for (int i = 0; i < UDP_MAX_FLOWS; i++) {
+            udp_name_t *n = &a->names[i];
+            if (n->state != UDP_NAME_PENDING || n->key_len != result.key_len || memcmp(n->key, result.key, n->key_len) != 0) continue;
+            n->state = result.state;
+            n->addr = result.addr;
+            n->expires_ns = now + (int64_t)UDP_NAME_TTL_MS * 1000000;
+            break;
+        }
+    }
+}
+
+/* resolved domain destination, NULL while it is unknown (a lookup is started) or failed */
+udp_name_t *udp_name_get(udp_assoc_t *a, const uint8_t *key, size_t key_len, int64_t now) {
+    udp_name_t *victim = NULL;
+    for (int i = 0; i < UDP_MAX_FLOWS; i++) {
+        udp_name_t *n = &a->names[i];
+        if (n->state != UDP_NAME_FREE && n->key_len == key_len && memcmp(n->key, key, key_len) == 0) {
+            if (n->state == UDP_NAME_PENDING) return NULL;
+            if (now < n->expires_ns) return n->state == UDP_NAME_OK ? n : NULL;
+            victim = n; /* expired, look it up again */
+            break;
+        }
+        if (n->state == UDP_NAME_PENDING || (victim && victim->state == UDP_NAME_FREE)) continue;
+        if (!victim || n->state == UDP_NAME_FREE || n->expires_ns < victim->expires_ns) victim = n;
+    }
+    if (!victim) return NULL; /* every slot waits for a lookup */
+    udp_lookup_t *l = malloc(sizeof(udp_lookup_t));
+    if (!l) return NULL;
+    memcpy(l->name.key, key, key_len);
+    l->name.key_len = key_len;
+    l->fd = dup(a->names_pipe[1]);
+    pthread_t tid;
+    if (l->fd < 0 || pthread_create(&tid, NULL, udp_lookup_thread, l) != 0) {
+        LOG_ERRNO(LOG_WARNING, "udp: lookup thread", NULL, 0, 0);
+        if (l->fd >= 0) close(l->fd);
+        free(l);
+        return NULL;
+    }
+    pthread_detach(tid);
+    memcpy(victim->key, key, key_len);
+    victim->key_len = key_len;
+    victim->state = UDP_NAME_PENDING;
+    return NULL;
+}
+
+/* flow for destination key, creates or replaces the least recently used one */
+udp_flow_t *udp_flow_get(udp_assoc_t *a, const uint8_t *key, size_t key_len, int64_t now) {
+    udp_flow_t *victim = &a->flows[0];
+    for (int i = 0; i < UDP_MAX_FLOWS; i++) {
+        udp_flow_t *f = &a->flows[i];
+        if (f->fd >= 0 && f->key_len == key_len && memcmp(f->key, key, key_len) == 0) return f;
+        if (victim->fd >= 0 && (f->fd < 0 || f->last_ns < victim->last_ns)) victim = f;
+    }
+    struct sockaddr_storage dst;
+    socklen_t dst_len;
+    if (socks5_sockaddr(key, &dst, &dst_len) < 0) {
+        udp_name_t *name = udp_name_get(a, key, key_len, now);
+        if (!name) return NULL;
+        dst = name->addr;
+        dst_len = dst.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    }
+    int fd = socket(dst.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&dst, dst_len) < 0) {
+        char host[256], port[8];
+        socks5_get_addr(key, host, sizeof(host), port);
+        LOG_ERRNO(LOG_INFO, "udp: connect %s", host, 0, 0);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    if (victim->fd >= 0) udp_flow_close(victim);
+    int on = 1;
+    victim->fd = fd;
+    victim->gro = setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    victim->last_ns = now;
+    memcpy(victim->key, key, key_len);
+    victim->key_len = key_len;
+    memset(victim->reply, 0, 3);
+    victim->reply_len = 3 + socks5_put_addr(victim->reply + 3, &dst);
+    return victim;
+}
+
+/* count datagrams from bufs/lens, as one GSO send when they have the same size */
+void udp_send(udp_assoc_t *a, int fd, const struct sockaddr_storage *to, socklen_t to_len, int count) {
+    size_t size = a->lens[0];
+    size_t total = 0;
+    int same = count > 1 && udp_gso;
+    for (int i = 0; i < count; i++) {
+        total += a->lens[i];
+        if (a->lens[i] != size && !(i == count - 1 && a->lens[i] < size)) same = 0;
+    }
+    if (same && total <= 65000) {
+        for (int i = 0, off = 0; i < count; off += a->lens[i], i++) memcpy(a->gso + off, a->bufs[i], a->lens[i]);
+        char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+        struct iovec iov = {a->gso, total};
+        struct msghdr msg = {0};
+        msg.msg_name = (void *)to;
+        msg.msg_namelen = to_len;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment = (uint16_t)size;
+        memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        if (sendmsg(fd, &msg, 0) >= 0) return;
+        /* EIO - no checksum offload on the route, EINVAL - bigger than MTU */
+        if (errno == EIO) udp_gso = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        a->out_iovs[i].iov_base = a->bufs[i];
+        a->out_iovs[i].iov_len = a->lens[i];
+        memset(&a->out_msgs[i].msg_hdr, 0, sizeof(a->out_msgs[i].msg_hdr));
+        a->out_msgs[i].msg_hdr.msg_name = (void *)to;
+        a->out_msgs[i].msg_hdr.msg_namelen = to_len;
+        a->out_msgs[i].msg_hdr.msg_iov = &a->out_iovs[i];
+        a->out_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (int sent = 0; sent < count;) {
+        int r = sendmmsg(fd, a->out_msgs + sent, count - sent, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            LOG_ERRNO(LOG_DEBUG, "udp: sendmmsg", NULL, 0, 0);
+            return;
+        }
+        sent += r;
+    }
+}
+
+/* client to upstream, one batch */
+void udp_from_client(udp_assoc_t *a, int64_t now) {
+    struct sockaddr_storage from[UDP_BATCH];
+    for (int i = 0; i < UDP_BATCH; i++) {
+        a->iovs[i].iov_base = a->rx + i * UDP_SLOT;
+        a->iovs[i].iov_len = UDP_SLOT;
+        memset(&a->msgs[i].msg_hdr, 0, sizeof(a->msgs[i].msg_hdr));
+        a->msgs[i].msg_hdr.msg_name = &from[i];
+        a->msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        a->msgs[i].msg_hdr.msg_iov = &a->iovs[i];
+        a->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = recvmmsg(a->udp_fd, a->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (count <= 0) return;
+    udp_flow_t *run = NULL;
+    int run_len = 0;
+    for (int i = 0; i <= count; i++) {
+        udp_flow_t *f = NULL;
+        uint8_t *p = NULL;
+        size_t len = 0;
+        if (i < count) {
+            p = a->rx + i * UDP_SLOT;
+            len = a->msgs[i].msg_len;
+            size_t addr_len = len > 3 ? socks5_addr_len(p + 3, len - 3) : 0;
+            /* fragmented datagrams (FRAG != 0) are not supported, RFC 1928 allows dropping them */
+            if (addr_len == 0 || p[2] != 0 || !same_ip(&from[i], &a->client) || (a->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) continue;
+            if (!a->client_port_known) {
+                memcpy(&a->client, &from[i], a->msgs[i].msg_hdr.msg_namelen);
+                a->client_len = a->msgs[i].msg_hdr.msg_namelen;
+                a->client_port_known = 1;
+            }
+            f = udp_flow_get(a, p + 3, addr_len, now);
+            if (!f) continue;
+            f->last_ns = now;
+            p += 3 + addr_len;
+            len -= 3 + addr_len;
+            if (quic_reorder && memcmp(f->key + f->key_len - 2, "\x01\xbb", 2) == 0 && len > 0 && (p[0] & 0x80)) {
+                if (quic_reorder_initial(p, len) == 0) {
+                    LOG(LOG_DEBUG, "quic: Initial CRYPTO frames reordered", NULL, 0, 0);
+                }
+            }
+        }
+        /* datagrams to one destination that came one after another go out together */
+        if (run && (f != run || i == count)) {
+            udp_send(a, run->fd, NULL, 0, run_len);
+            a->up += run_len;
+            run_len = 0;
+        }
+        if (f) {
+            run = f;
+            a->bufs[run_len] = p;
+            a->lens[run_len++] = len;
+        }
+    }
+}
+
+/* upstream to client, one batch from flow f */
+void udp_from_upstream(udp_assoc_t *a, udp_flow_t *f, int64_t now) {
+    int count = 0;
+    uint8_t *tx = a->tx;
+    size_t room = f->reply_len;
+    while (f->gro && count < UDP_BATCH) {
+        /* one read gives several datagrams glued together, segment size in control message */
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = {a->rx, sizeof(a->rx)};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(f->fd, &msg, MSG_DONTWAIT);
+        if (n <= 0) break;
+        size_t segment = (size_t)n;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                if (size > 0) segment = (size_t)size;
+            }
+        }
+        for (size_t off = 0; off < (size_t)n && count < UDP_BATCH; off += segment) {
+            size_t len = (size_t)n - off < segment ? (size_t)n - off : segment;
+            if (len + room > UDP_SLOT) continue;
+            a->bufs[count] = tx + count * UDP_SLOT;
+            memcpy(a->bufs[count], f->reply, room);
+            memcpy(a->bufs[count] + room, a->rx + off, len);
+            a->lens[count++] = room + len;
+        }
+    }
+    if (!f->gro) {
+        for (int i = 0; i < UDP_BATCH; i++) {
+            /* reply header goes in front of every datagram, read right after it */
+            memcpy(tx + i * UDP_SLOT, f->reply, room);
+            a->iovs[i].iov_base = tx + i * UDP_SLOT + room;
+            a->iovs[i].iov_len = UDP_SLOT - room;
+            memset(&a->msgs[i].msg_hdr, 0, sizeof(a->msgs[i].msg_hdr));
+            a->msgs[i].msg_hdr.msg_iov = &a->iovs[i];
+            a->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int r = recvmmsg(f->fd, a->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        for (int i = 0; i < r; i++) {
+            if (a->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+            a->bufs[count] = tx + i * UDP_SLOT;
+            a->lens[count++] = room + a->msgs[i].msg_len;
+        }
+    }
+    f->last_ns = now;
+    if (count > 0 && a->client_port_known) {
+        udp_send(a, a->udp_fd, &a->client, a->client_len, count);
+        a->down += count;
+    }
+}
+
+void udp_associate(int tcp_fd, int udp_fd, const struct sockaddr_storage *client) {
+    udp_assoc_t *a = malloc(sizeof(udp_assoc_t));
+    if (!a) {
+        LOG_ERRNO(LOG_ERR, "malloc", NULL, 0, 0);
+        return;
+    }
+    a->tcp_fd = tcp_fd;
+    a->udp_fd = udp_fd;
+    a->client = *client;
+    a->client_len = sizeof(a->client);
+    a->client_port_known = 0;
+    a->up = a->down = 0;
+    for (int i = 0; i < UDP_MAX_FLOWS; i++) {
+        a->flows[i].fd = -1;
+        a->names[i].state = UDP_NAME_FREE;
+    }
+    if (pipe(a->names_pipe) < 0) {
+        LOG_ERRNO(LOG_ERR, "udp: pipe", NULL, 0, 0);
+        free(a);
+        return;
+    }
+    fcntl(a->names_pipe[0], F_SETFL, O_NONBLOCK);
+    struct pollfd pfds[3 + UDP_MAX_FLOWS];
+    udp_flow_t *polled[UDP_MAX_FLOWS];
+    while (1) {
+        int n = 0;
+        pfds[n].fd = tcp_fd;
+        pfds[n++].events = POLLIN;
+        pfds[n].fd = udp_fd;
+        pfds[n++].events = POLLIN;
+        pfds[n].fd = a->names_pipe[0];
+        pfds[n++].events = POLLIN;
+        for (int i = 0; i < UDP_MAX_FLOWS; i++) {
+            if (a->flows[i].fd < 0) continue;
+            polled[n - 3] = &a->flows[i];
+            pfds[n].fd = a->flows[i].fd;
+            pfds[n++].events = POLLIN;
+        }
+        int r = poll(pfds, n, 1000);
+        if (r < 0 && errno != EINTR) break;
+        if (r > 0 && pfds[0].revents) {
+            /* association lives as long as its TCP connection */
+            char byte;
+            ssize_t got = recv(tcp_fd, &byte, 1, MSG_DONTWAIT);
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) break;
+        }
+        int64_t now = now_ns();
+        if (r > 0 && (pfds[2].revents & POLLIN)) udp_names_read(a, now);
+        if (r > 0 && (pfds[1].revents & POLLIN)) udp_from_client(a, now);
+        for (int i = 3; r > 0 && i < n; i++) {
+            if (pfds[i].revents && polled[i - 3]->fd == pfds[i].fd) udp_from_upstream(a, polled[i - 3], now);
+        }
+        for (int i = 0; i < UDP_MAX_FLOWS; i++) {
+            if (a->flows[i].fd >= 0 && now - a->flows[i].last_ns > (int64_t)UDP_FLOW_IDLE_MS * 1000000) {
+                udp_flow_close(&a->flows[i]);
+            }
+        }
+    }
+    for (int i = 0; i < UDP_MAX_FLOWS; i++) {
+        if (a->flows[i].fd >= 0) udp_flow_close(&a->flows[i]);
+    }
+    close(a->names_pipe[0]);
+    close(a->names_pipe[1]);
+    LOG(LOG_DEBUG, "udp: association closed, %u datagrams up, %u down", NULL, (int64_t)a->up, (int64_t)a->down);
+    free(a);
+}
+
+/*
+Greeting and request of a SOCKS5 client, first bytes are in buffer, the rest
+must come before deadline. Returns connected remote socket for CONNECT (reply
+already sent, host and port filled, *early points to bytes of buffer sent
+after the request) or relay socket for UDP ASSOCIATE with *udp set, -1 on error.
+*/
+int socks5_request(int client_fd, const uint8_t *buffer, size_t n, int64_t deadline, char *host, size_t host_size, char port[8],
+                   int *udp, const uint8_t **early, size_t *early_len) {
+    uint8_t greeting[2 + 255];
+    size_t have = n < sizeof(greeting) ? n : sizeof(greeting);
+    memcpy(greeting, buffer, have);
+    if (have < 2 && read_n_until(client_fd, greeting + have, 2 - have, deadline) != (ssize_t)(2 - have)) return -1;
+    have = have < 2 ? 2 : have;
+    size_t greeting_len = 2 + (size_t)greeting[1];
+    if (have < greeting_len && read_n_until(client_fd, greeting + have, greeting_len - have, deadline) != (ssize_t)(greeting_len - have)) return -1;
+    if (!memchr(greeting + 2, 0, greeting[1])) {
+        write_n(client_fd, "\x05\xff", 2);
+        return -1;
+    }
+    if (write_n(client_fd, "\x05\x00", 2) != 2) return -1;
+    uint8_t req[4 + 1 + 255 + 2];
+    const uint8_t *rest = buffer + (n > greeting_len ? greeting_len : n);
+    size_t rest_len = n > greeting_len ? n - greeting_len : 0;
+    have = rest_len < sizeof(req) ? rest_len : sizeof(req);
+    memcpy(req, rest, have);
+    if (have < 5 && read_n_until(client_fd, req + have, 5 - have, deadline) != (ssize_t)(5 - have)) return -1;
+    have = have < 5 ? 5 : have;
+    size_t need = req[3] == 1 ? 4 + 4 + 2 : req[3] == 4 ? 4 + 16 + 2 : req[3] == 3 ? 5 + (size_t)req[4] + 2 : 0;
+    if (req[0] != SOCKS5_VERSION || need == 0) {
+        socks5_reply(client_fd, SOCKS5_BAD_ADDRESS, NULL);
+        return -1;
+    }
+    if (have < need && read_n_until(client_fd, req + have, need - have, deadline) != (ssize_t)(need - have)) return -1;
+    /* pipelined after the request, e.g. a ClientHello of an optimistic client */
+    *early = rest_len > need ? rest + need : NULL;
+    *early_len = rest_len > need ? rest_len - need : 0;
+    if (req[1] == 3) {
+        struct sockaddr_storage local = {0};
+        socklen_t local_len = sizeof(local);
+        getsockname(client_fd, (struct sockaddr *)&local, &local_len);
+        if (local.ss_family != AF_INET && local.ss_family != AF_INET6) {
+            socks5_reply(client_fd, SOCKS5_FAIL, NULL);
+            return -1;
+        }
+        ((struct sockaddr_in *)&local)->sin_port = 0; /* same offset in sockaddr_in6 */
+        int udp_fd = socket(local.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (udp_fd < 0 || bind(udp_fd, (struct sockaddr *)&local, local_len) < 0 ||
+            getsockname(udp_fd, (struct sockaddr *)&local, &local_len) < 0) {
+            LOG_ERRNO(LOG_WARNING, "udp: relay socket", NULL, 0, 0);
+            if (udp_fd >= 0) close(udp_fd);
+            socks5_reply(client_fd, SOCKS5_FAIL, NULL);
+            return -1;
+        }
+        if (socks5_reply(client_fd, SOCKS5_OK, &local) < 0) {
+            close(udp_fd);
+            return -1;
+        }
+        *udp = 1;
+        return udp_fd;
+    }
+    if (req[1] != 1) {
+        socks5_reply(client_fd, SOCKS5_BAD_COMMAND, NULL);
+        return -1;
+    }
+    if (socks5_get_addr(req + 3, host, host_size, port) < 0) {
+        socks5_reply(client_fd, SOCKS5_BAD_ADDRESS, NULL);
+        return -1;
+    }
+    int remote_fd = connect_remote(host, port);
+    if (remote_fd < 0) {
+        socks5_reply(client_fd, SOCKS5_UNREACHABLE, NULL);
+        return -1;
+    }
+    if (socks5_reply(client_fd, SOCKS5_OK, NULL) < 0) {
+        close(remote_fd);
+        return -1;
+    }
+    return remote_fd;
+}
+#endif
+
+/* fragments the first client bytes for https (early ones first) and makes a tunnel, remote_fd is closed on failure */
+tunnel_t *tunnel_open(int client_fd, int remote_fd, const char *host, const char *port, const uint8_t *early, size_t early_len) {
+#ifdef SOCKET_PROFILES
+    profile_apply(client_fd, PROFILE_HANDSHAKE, PROFILE_HANDSHAKE);
+    profile_apply(remote_fd, PROFILE_HANDSHAKE, PROFILE_HANDSHAKE);
+#endif
+    int fragment = strcmp(port, "443") == 0;
+#ifdef CIDR_RULES
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(remote_fd, (struct sockaddr *)&peer, &peer_len) == 0) {
+        int action = rule_match((struct sockaddr *)&peer);
+        if (action == RULE_FRAGMENT) fragment = 1;
+        if (action == RULE_BYPASS) fragment = 0;
+#ifdef METRICS
+        __atomic_add_fetch(&rule_hits[action], 1, __ATOMIC_RELAXED);
+#endif
+    }
+#endif
+    frag_strategy_t strategy = FRAG_STRONGEST;
+#ifdef ADAPTIVE_FRAGMENT
+    if (fragment) {
+        strategy = strategy_get(host);
+    }
+#endif
+    if (fragment) {
+        if (fragment_data(client_fd, remote_fd, strategy, early, early_len) < 0) {
+            close(remote_fd);
+            return NULL;
+        }
+    } else if (early_len && write_n(remote_fd, early, early_len) != (ssize_t)early_len) {
+        close(remote_fd);
+        return NULL;
+    }
+    tunnel_t *t = tunnel_new(client_fd, remote_fd);
+    if (!t) {
+        close(remote_fd);
+        return NULL;
+    }
+#ifdef ADAPTIVE_FRAGMENT
+    t->dirs[1].watch_handshake = fragment;
+    t->dirs[1].strategy = strategy;
+    snprintf(t->dirs[1].host, sizeof(t->dirs[1].host), "%s", host);
+#else
+    (void)host;
+#endif
+    return t;
+}
+
+#ifdef MUX_LINK
+/*
+Multiplexed upstream link. With -U host:port CONNECT tunnels are not dialed
+here but opened as streams over MUX_LINKS long-lived connections to a peer
+proxy, which runs connect_remote, fragmentation and relay threads for them, so
+a new tunnel costs no TCP handshake on the uplink. The client gets 200 as soon
+as the stream is opened and its first bytes follow the open request at once.
+A link starts with MUX_PREFACE sent by the dialing side, then frames: 8 byte
+header (type, flags, big endian payload length, big endian stream id) and
+payload. OPEN carries host:port, DATA bytes, WINDOW 4 byte credit, CLOSE ends
+the sender's direction (MUX_FIN) or the whole stream (MUX_RESET).
+Every stream may send MUX_INITIAL_WINDOW bytes per direction without credit, a
+receiver with bigger MUX_WINDOW grants the rest right after open. Received
+bytes wait in a per stream ring of MUX_WINDOW bytes and credit goes back as
+they are written out, so one slow client never stalls the link.
+A stream has two threads like a tunnel, fd to link and link to fd. The fd is
+the client socket on the dialing side and one end of a socketpair on the peer,
+the other end is the client side of an ordinary tunnel.
+*/
+#define MUX_PREFACE "PXMUX/1\r\n"
+#define MUX_PREFACE_LEN 9
+#define MUX_HEADER 8
+#define MUX_FRAME_MAX 16384
+#define MUX_INITIAL_WINDOW 16384 /* protocol constant, both ends must agree */
+#define MUX_BUCKETS 64
+
+#if MUX_WINDOW < MUX_INITIAL_WINDOW
+#error MUX_WINDOW must be at least 16384
+#endif
+
+enum { MUX_OPEN = 1, MUX_DATA, MUX_WINDOW_UPDATE, MUX_CLOSE };
+enum { MUX_FIN = 0, MUX_RESET };
+
+typedef struct mux_link mux_link_t;
+
+typedef struct mux_stream {
+    struct mux_stream *next; /* bucket */
+    mux_link_t *link;
+    uint32_t id;
+    int fd;
+    int refs;  /* stream threads not done yet */
+    int reset;
+    int recv_fin;
+    uint32_t send_window;
+    size_t recv_head;
+    size_t recv_len;
+    pthread_cond_t cond; /* fields above are guarded by link->lock */
+#ifdef SOURCE_LIMITS
+    source_t *source;
+#endif
+    uint8_t ring[MUX_WINDOW];
+} mux_stream_t;
+
+struct mux_link {
+    int fd;
+    int refs; /* reader, streams and the mux_links slot */
+    int dead;
+    int accepted; /* peer side, streams are opened by the other end only */
+    int streams;
+    uint32_t next_id;
+    pthread_mutex_t lock;
+    pthread_mutex_t write_lock;
+    mux_stream_t *buckets[MUX_BUCKETS];
+    size_t early_len; /* frame bytes read together with the preface */
+    size_t early_pos;
+    uint8_t early[HTTP_REQUEST_MAX - MUX_PREFACE_LEN]; /* rest of the first read of handle_client */
+#ifdef FAIR_SCHEDULER
+    struct sockaddr_storage addr;
+#endif
+#ifdef SOURCE_LIMITS
+    source_t *source;
+#endif
+};
+
+static char *mux_peer_host = NULL; /* -U */
+static char *mux_peer_port = NULL;
+static mux_link_t *mux_links[MUX_LINKS];
+static pthread_mutex_t mux_links_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef METRICS
+static int metrics_mux_links = 0;
+static int metrics_mux_streams = 0;
+#endif
+
+/* -U option value: host:port or [ipv6]:port */
+int mux_parse_peer(const char *spec) {
+    char *host = strdup(spec);
+    if (!host) return -1;
+    char *colon = strrchr(host, ':');
+    if (!colon || colon == host || !colon[1]) {
+        free(host);
+        return -1;
+    }
+    *colon = 0;
+    if (host[0] == '[' && colon[-1] == ']') {
+        colon[-1] = 0;
+        memmove(host, host + 1, strlen(host));
+    }
+    mux_peer_host = host;
+    mux_peer_port = colon + 1;
+    return 0;
+}
+
+mux_link_t *mux_link_new(int fd, int accepted) {
+    mux_link_t *l = calloc(1, sizeof(mux_link_t));
+    if (!l) return NULL;
+    l->fd = fd;
+    l->refs = 1;
+    l->accepted = accepted;
+    l->next_id = 1;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_mutex_init(&l->write_lock, NULL);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef METRICS
+    __sync_add_and_fetch(&metrics_mux_links, 1);
+#endif
+    return l;
+}
+
+void mux_link_release(mux_link_t *l) {
+    pthread_mutex_lock(&l->lock);
+    int last = --l->refs == 0;
+    pthread_mutex_unlock(&l->lock);
+    if (!last) return;
+    close(l->fd);
+#ifdef SOURCE_LIMITS
+    source_release(l->source);
+#endif
+#ifdef METRICS
+    __sync_sub_and_fetch(&metrics_mux_links, 1);
+#endif
+    pthread_mutex_destroy(&l->lock);
+    pthread_mutex_destroy(&l->write_lock);
+    free(l);
+}
+
+/* frame has MUX_HEADER bytes for the header in front of the payload */
+int mux_send(mux_link_t *l, int type, int flags, uint32_t id, uint8_t *frame, size_t len) {
+    frame[0] = (uint8_t)type;
+    frame[1] = (uint8_t)flags;
+    frame[2] = (uint8_t)(len >> 8);
+    frame[3] = (uint8_t)len;
+    uint32_t id_be = htonl(id);
+    memcpy(frame + 4, &id_be, 4);
+    pthread_mutex_lock(&l->write_lock);
+    ssize_t w = write_n(l->fd, frame, MUX_HEADER + len);
+    pthread_mutex_unlock(&l->write_lock);
+    if (w != (ssize_t)(MUX_HEADER + len)) {
+        /* the reader sees it and tears the link down */
+        shutdown(l->fd, SHUT_RDWR);
+        return -1;
+    }
+    return 0;
+}
+
+void mux_send_window(mux_link_t *l, uint32_t id, uint32_t credit) {
+    uint8_t frame[MUX_HEADER + 4];
+    uint32_t credit_be = htonl(credit);
+    memcpy(frame + MUX_HEADER, &credit_be, 4);
+    mux_send(l, MUX_WINDOW_UPDATE, 0, id, frame, 4);
+}
+
+void mux_send_close(mux_link_t *l, uint32_t id, int flags) {
+    uint8_t frame[MUX_HEADER];
+    mux_send(l, MUX_CLOSE, flags, id, frame, 0);
+}
+
+/* link->lock held */
+mux_stream_t *mux_stream_find(mux_link_t *l, uint32_t id) {
+    mux_stream_t *s = l->buckets[id % MUX_BUCKETS];
+    while (s && s->id != id) s = s->next;
+    return s;
+}
+
+/* id 0 - next own id; NULL if the link is dead or id is taken */
+mux_stream_t *mux_stream_new(mux_link_t *l, uint32_t id, int fd) {
+    mux_stream_t *s = calloc(1, sizeof(mux_stream_t));
+    if (!s) return NULL;
+    s->link = l;
+    s->fd = fd;
+    s->refs = 2;
+    s->send_window = MUX_INITIAL_WINDOW;
+    pthread_cond_init(&s->cond, NULL);
+    pthread_mutex_lock(&l->lock);
+    if (id == 0) id = l->next_id++;
+    if (l->dead || mux_stream_find(l, id)) {
+        pthread_mutex_unlock(&l->lock);
+        pthread_cond_destroy(&s->cond);
+        free(s);
+        return NULL;
+    }
+    s->id = id;
+    s->next = l->buckets[id % MUX_BUCKETS];
+    l->buckets[id % MUX_BUCKETS] = s;
+    l->streams++;
+    l->refs++;
+    pthread_mutex_unlock(&l->lock);
+#ifdef METRICS
+    __sync_add_and_fetch(&metrics_mux_streams, 1);
+#endif
+    return s;
+}
+
+void mux_stream_release(mux_stream_t *s) {
+    mux_link_t *l = s->link;
+    pthread_mutex_lock(&l->lock);
+    int last = --s->refs == 0;
+    if (last) {
+        mux_stream_t **pp = &l->buckets[s->id % MUX_BUCKETS];
+        while (*pp != s) pp = &(*pp)->next;
+        *pp = s->next;
+        l->streams--;
+    }
+    pthread_mutex_unlock(&l->lock);
+    if (!last) return;
+    close(s->fd);
+#ifdef SOURCE_LIMITS
+    source_release(s->source);
+#endif
+#ifdef METRICS
+    __sync_sub_and_fetch(&metrics_mux_streams, 1);
+#endif
+    pthread_cond_destroy(&s->cond);
+    free(s);
+    mux_link_release(l);
+}
+
+/* local failure, the other end gets MUX_RESET */
+void mux_stream_reset(mux_stream_t *s) {
+    mux_link_t *l = s->link;
+    pthread_mutex_lock(&l->lock);
+    int notify = !s->reset;
+    s->reset = 1;
+    shutdown(s->fd, SHUT_RDWR);
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&l->lock);
+    if (notify) mux_send_close(l, s->id, MUX_RESET);
+}
+
+/* fd to link */
+void *mux_up(void *arg) {
+    mux_stream_t *s = (mux_stream_t *)arg;
+    mux_link_t *l = s->link;
+    uint8_t frame[MUX_HEADER + MUX_FRAME_MAX];
+    while (1) {
+        pthread_mutex_lock(&l->lock);
+        while (s->send_window == 0 && !s->reset) pthread_cond_wait(&s->cond, &l->lock);
+        int reset = s->reset;
+        size_t want = s->send_window < MUX_FRAME_MAX ? s->send_window : MUX_FRAME_MAX;
+        pthread_mutex_unlock(&l->lock);
+        if (reset) break;
+        ssize_t n = read(s->fd, frame + MUX_HEADER, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            pthread_mutex_lock(&l->lock);
+            reset = s->reset;
+            pthread_mutex_unlock(&l->lock);
+            if (n < 0) {
+                LOG_ERRNO(LOG_DEBUG, "mux: read", NULL, 0, 0);
+                mux_stream_reset(s);
+            } else if (!reset) {
+                mux_send_close(l, s->id, MUX_FIN);
+            }
+            break;
+        }
+        pthread_mutex_lock(&l->lock);
+        s->send_window -= (uint32_t)n;
+        pthread_mutex_unlock(&l->lock);
+        if (mux_send(l, MUX_DATA, 0, s->id, frame, (size_t)n) < 0) break;
+    }
+    mux_stream_release(s);
+    return NULL;
+}
+
+/* link to fd, the reader only appends to the ring, so writing out of it needs no lock */
+void *mux_down(void *arg) {
+    mux_stream_t *s = (mux_stream_t *)arg;
+    mux_link_t *l = s->link;
+    uint32_t credit = 0;
+    while (1) {
+        pthread_mutex_lock(&l->lock);
+        while (s->recv_len == 0 && !s->recv_fin && !s->reset) pthread_cond_wait(&s->cond, &l->lock);
+        int reset = s->reset;
+        size_t head = s->recv_head;
+        size_t len = s->recv_len;
+        pthread_mutex_unlock(&l->lock);
+        if (reset) break;
+        if (len == 0) {
+            shutdown(s->fd, SHUT_WR);
+            break;
+        }
+        if (len > MUX_WINDOW - head) len = MUX_WINDOW - head;
+        if (write_n(s->fd, s->ring + head, len) != (ssize_t)len) {
+            LOG_ERRNO(LOG_DEBUG, "mux: write", NULL, 0, 0);
+            mux_stream_reset(s);
+            break;
+        }
+        pthread_mutex_lock(&l->lock);
+        s->recv_head = (head + len) % MUX_WINDOW;
+        s->recv_len -= len;
+        pthread_mutex_unlock(&l->lock);
+        credit += (uint32_t)len;
+        if (credit >= MUX_WINDOW / 4) {
+            mux_send_window(l, s->id, credit);
+            credit = 0;
+        }
+    }
+    mux_stream_release(s);
+    return NULL;
+}
+
+void mux_stream_start(mux_stream_t *s) {
+    void *(*fns[2])(void *) = {mux_up, mux_down};
+    if (MUX_WINDOW > MUX_INITIAL_WINDOW) mux_send_window(s->link, s->id, MUX_WINDOW - MUX_INITIAL_WINDOW);
+    for (int i = 0; i < 2; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, fns[i], s) != 0) {
+            LOG_ERRNO(LOG_ERR, "pthread_create", NULL, 0, 0);
+            mux_stream_reset(s);
+            mux_stream_release(s);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
+
+typedef struct {
+    int fd;
+    char host[MUX_FRAME_MAX];
+    char port[8];
+#ifdef FAIR_SCHEDULER
+    struct sockaddr_storage addr;
+#endif
+} mux_connect_t;
+
+/* peer side of OPEN: an ordinary tunnel whose client is the socketpair end */
+void *mux_connect(void *arg) {
+    mux_connect_t *c = (mux_connect_t *)arg;
+    int remote_fd = connect_remote(c->host, c->port);
+    tunnel_t *t = remote_fd < 0 ? NULL : tunnel_open(c->fd, remote_fd, c->host, c->port, NULL, 0);
+    if (t) {
+#ifdef FAIR_SCHEDULER
+        t->addr = c->addr;
+#endif
+        tunnel_start(t);
+    } else {
+        close(c->fd);
+    }
+    free(c);
+    return NULL;
+}
+
+/* -1 only for protocol errors, a stream that can't be opened is reset */
+int mux_accept_stream(mux_link_t *l, uint32_t id, const uint8_t *payload, size_t len) {
+    if (!l->accepted) return -1;
+    mux_connect_t *c = calloc(1, sizeof(mux_connect_t));
+    const uint8_t *colon = len ? memrchr(payload, ':', len) : NULL;
+    size_t host_len = colon ? (size_t)(colon - payload) : 0;
+    size_t port_len = colon ? len - host_len - 1 : 0;
+    int sp[2];
+    if (!c || host_len == 0 || host_len >= sizeof(c->host) || port_len == 0 || port_len >= sizeof(c->port) ||
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sp) < 0) {
+        free(c);
+        mux_send_close(l, id, MUX_RESET);
+        return 0;
+    }
+    memcpy(c->host, payload, host_len);
+    memcpy(c->port, colon + 1, port_len);
+    c->fd = sp[0];
+#ifdef FAIR_SCHEDULER
+    c->addr = l->addr;
+#endif
+    mux_stream_t *s = mux_stream_new(l, id, sp[1]);
+    if (!s) {
+        close(sp[0]);
+        close(sp[1]);
+        free(c);
+        mux_send_close(l, id, MUX_RESET);
+        return 0;
+    }
+    mux_stream_start(s);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, mux_connect, c) != 0) {
+        LOG_ERRNO(LOG_ERR, "pthread_create", NULL, 0, 0);
+        close(sp[0]);
+        free(c);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int mux_frame(mux_link_t *l, int type, int flags, uint32_t id, const uint8_t *payload, size_t len) {
+    if (type == MUX_OPEN) return mux_accept_stream(l, id, payload, len);
+    pthread_mutex_lock(&l->lock);
+    mux_stream_t *s = mux_stream_find(l, id);
+    int ok = 0;
+    if (!s) {
+        /* closed meanwhile, frames in flight are dropped */
+    } else if (type == MUX_DATA) {
+        ok = len <= MUX_WINDOW - s->recv_len ? 0 : -1;
+        if (ok == 0 && !s->reset) {
+            size_t tail = (s->recv_head + s->recv_len) % MUX_WINDOW;
+            size_t first = len < MUX_WINDOW - tail ? len : MUX_WINDOW - tail;
+            memcpy(s->ring + tail, payload, first);
+            memcpy(s->ring, payload + first, len - first);
+            s->recv_len += len;
+        }
+    } else if (type == MUX_WINDOW_UPDATE && len == 4) {
+        uint32_t credit;
+        memcpy(&credit, payload, 4);
+        s->send_window += ntohl(credit);
+    } else if (type == MUX_CLOSE) {
+        if (flags == MUX_RESET) {
+            s->reset = 1;
+            shutdown(s->fd, SHUT_RDWR);
+        } else {
+            s->recv_fin = 1;
+        }
+    } else {
+        ok = -1;
+    }
+    if (s) pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&l->lock);
+    return ok;
+}
+
+int mux_read(mux_link_t *l, uint8_t *buf, size_t n) {
+    size_t early = l->early_len - l->early_pos;
+    if (early > n) early = n;
+    memcpy(buf, l->early + l->early_pos, early);
+    l->early_pos += early;
+    if (early < n && read_n(l->fd, buf + early, n - early) != (ssize_t)(n - early)) return -1;
+    return 0;
+}
+
+/* runs until the link breaks, then resets its streams and drops the reader reference */
+void mux_reader(mux_link_t *l) {
+    uint8_t payload[MUX_FRAME_MAX];
+    uint8_t head[MUX_HEADER];
+    while (mux_read(l, head, MUX_HEADER) == 0) {
+        size_t len = ((size_t)head[2] << 8) | head[3];
+        uint32_t id;
+        memcpy(&id, head + 4, 4);
+        if (len > MUX_FRAME_MAX || mux_read(l, payload, len) < 0) break;
+        if (mux_frame(l, head[0], head[1], ntohl(id), payload, len) < 0) {
+            LOG(LOG_WARNING, "mux: protocol error (frame type %d), closing link", NULL, head[0], 0);
+            break;
+        }
+    }
+    int streams = 0;
+    pthread_mutex_lock(&l->lock);
+    l->dead = 1;
+    for (int i = 0; i < MUX_BUCKETS; i++) {
+        for (mux_stream_t *s = l->buckets[i]; s; s = s->next) {
+            s->reset = 1;
+            shutdown(s->fd, SHUT_RDWR);
+            pthread_cond_broadcast(&s->cond);
+            streams++;
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+    shutdown(l->fd, SHUT_RDWR);
+    LOG(LOG_INFO, "mux: link closed, %d streams reset", NULL, streams, 0);
+    mux_link_release(l);
+}
+
+void *mux_reader_thread(void *arg) {
+    mux_reader((mux_link_t *)arg);
+    return NULL;
+}
+
+/* peer side, the handshake thread becomes the link reader */
+void mux_serve(client_t *client, const uint8_t *early, size_t early_len) {
+    mux_link_t *l = early_len <= sizeof(l->early) ? mux_link_new(client->fd, 1) : NULL;
+    if (!l) {
+        close(client->fd);
+#ifdef SOURCE_LIMITS
+        source_release(client->source);
+#endif
+        free(client);
+        return;
+    }
+    memcpy(l->early, early, early_len);
+    l->early_len = early_len;
+#ifdef FAIR_SCHEDULER
+    l->addr = client->addr;
+#endif
+#ifdef SOURCE_LIMITS
+    l->source = client->source;
+#endif
+    free(client);
+    LOG(LOG_INFO, "mux: link accepted", NULL, 0, 0);
+    mux_reader(l);
+}
+
+/* dialing side, the new link has references of its reader and of the mux_links slot */
+mux_link_t *mux_link_connect(void) {
+    int fd = connect_remote(mux_peer_host, mux_peer_port);
+    if (fd < 0) {
+        LOG(LOG_WARNING, "mux: can't connect to %s", mux_peer_host, 0, 0);
+        return NULL;
+    }
+    mux_link_t *l = NULL;
+    if (write_n(fd, MUX_PREFACE, MUX_PREFACE_LEN) != MUX_PREFACE_LEN || !(l = mux_link_new(fd, 0))) {
+        close(fd);
+        return NULL;
+    }
+    l->refs = 2;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, mux_reader_thread, l) != 0) {
+        LOG_ERRNO(LOG_ERR, "pthread_create", NULL, 0, 0);
+        l->refs = 1;
+        mux_link_release(l);
+        return NULL;
+    }
+    pthread_detach(tid);
+    LOG(LOG_INFO, "mux: link to %s up", mux_peer_host, 0, 0);
+    return l;
+}
+
+/* new stream on the least loaded link, dead links are replaced (dialed without the lock) */
+mux_stream_t *mux_stream_open(int fd) {
+    pthread_mutex_lock(&mux_links_lock);
+    int best = 0;
+    for (int i = 0; i < MUX_LINKS; i++) {
+        mux_link_t *l = mux_links[i];
+        if (!l || l->dead) {
+            best = i;
+            break;
+        }
+        if (l->streams < mux_links[best]->streams) best = i;
+    }
+    if (!mux_links[best] || mux_links[best]->dead) {
+        pthread_mutex_unlock(&mux_links_lock);
+        mux_link_t *fresh = mux_link_connect();
+        pthread_mutex_lock(&mux_links_lock);
+        mux_link_t *old = mux_links[best];
+        if (!old || old->dead) {
+            mux_links[best] = fresh;
+            if (old) mux_link_release(old);
+        } else if (fresh) {
+            /* another thread was faster */
+            shutdown(fresh->fd, SHUT_RDWR);
+            mux_link_release(fresh);
+        }
+    }
+    mux_stream_t *s = mux_links[best] ? mux_stream_new(mux_links[best], 0, fd) : NULL;
+    pthread_mutex_unlock(&mux_links_lock);
+    return s;
+}
+
+/* dialing side of CONNECT, client_fd belongs to the stream on success; early bytes fit the initial window */
+int mux_open(int client_fd, const char *host, const char *port, client_t *client, const uint8_t *early, size_t early_len) {
+    uint8_t frame[MUX_HEADER + MUX_FRAME_MAX];
+    int len = snprintf((char *)frame + MUX_HEADER, MUX_FRAME_MAX, "%s:%s", host, port);
+    if (len >= MUX_FRAME_MAX || early_len > MUX_INITIAL_WINDOW) return -1;
+    mux_stream_t *s = mux_stream_open(client_fd);
+    if (!s) return -1;
+#ifdef SOURCE_LIMITS
+    s->source = client->source;
+#else
+    (void)client;
+#endif
+    s->send_window -= (uint32_t)early_len;
+    const char *resp = "HTTP/1.1 200 OK\r\n\r\n";
+    int ok = mux_send(s->link, MUX_OPEN, 0, s->id, frame, (size_t)len) == 0;
+    while (ok && early_len) {
+        size_t chunk = early_len < MUX_FRAME_MAX ? early_len : MUX_FRAME_MAX;
+        memcpy(frame + MUX_HEADER, early, chunk);
+        ok = mux_send(s->link, MUX_DATA, 0, s->id, frame, chunk) == 0;
+        early += chunk;
+        early_len -= chunk;
+    }
+    /* on failure the threads only see the reset and release the stream */
+    if (!ok || write_n(client_fd, resp, strlen(resp)) != (ssize_t)strlen(resp)) {
+        mux_stream_reset(s);
+    }
+    mux_stream_start(s);
+    return 0;
+}
+#endif
+
+/*
+HTTP/1.x request parser. Works in place on the receive buffer and keeps only
+pointers into it, so a request that arrives in pieces is parsed by calling
+http_parse again after every read with the grown length; finished lines and
+the part of the current line already searched are not looked at again.
+Line ends are found 16 bytes at a time with SSE2, 8 bytes at a time (SWAR) on
+other CPUs. Request line words and header values are NUL terminated in place,
+Host and Proxy-Authorization are kept, other headers are only counted. When
+the request is complete end is where pipelined payload (e.g. a ClientHello
+sent without waiting for 200) starts.
+*/
+typedef struct {
+    size_t pos;      /* first byte of the line being parsed */
+    size_t scanned;  /* bytes after pos known to have no line feed */
+    size_t end;      /* first byte after the empty line, 0 until complete */
+    int headers;
+    char *method;
+    char *target;
+    char *version;
+    char *host;
+    char *proxy_authorization;
+} http_request_t;
+
+/* index of the first c in p[0..len) or len */
+size_t http_find(const char *p, size_t len, char c) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi8(c);
+    for (; i + 16 <= len; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), needle));
+        if (mask) return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+#else
+    const uint64_t low7 = 0x7f7f7f7f7f7f7f7full;
+    const uint64_t pattern = 0x0101010101010101ull * (uint8_t)c;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        v ^= pattern;
+        /* high bit of every zero byte and only of those (no borrow between bytes) */
+        uint64_t zero = ~(((v & low7) + low7) | v | low7);
+        if (zero) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + (size_t)__builtin_ctzll(zero) / 8;
+#else
+            return i + (size_t)__builtin_clzll(zero) / 8;
+#endif
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] == c) return i;
+    }
+    return len;
+}
+
+/* next space separated word of the request line, NUL terminated */
+char *http_word(char **p, char *line_end) {
+    char *word = *p;
+    size_t n = http_find(word, (size_t)(line_end - word), ' ');
+    if (n == 0) return NULL;
+    word[n] = 0;
+    *p = word + n + (word + n < line_end);
+    return word;
+}
+
+/* 1 - complete, 0 - needs more bytes, -1 - malformed */
+int http_parse(http_request_t *req, char *buf, size_t len) {
+    while (!req->end) {
+        char *line = buf + req->pos;
+        size_t avail = len - req->pos;
+        size_t lf = req->scanned + http_find(line + req->scanned, avail - req->scanned, '\n');
+        if (lf == avail) {
+            req->scanned = avail;
+            return 0;
+        }
+        char *line_end = line + lf;
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+        *line_end = 0;
+        req->pos += lf + 1;
+        req->scanned = 0;
+        if (!req->method) {
+            char *p = line;
+            if (!(req->method = http_word(&p, line_end)) || !(req->target = http_word(&p, line_end)) ||
+                !(req->version = http_word(&p, line_end)) || p != line_end || strncmp(req->version, "HTTP/1.", 7) != 0) {
+                return -1;
+            }
+        } else if (line_end == line) {
+            req->end = req->pos;
+        } else {
+            /* obsolete line folding is not accepted */
+            if (*line == ' ' || *line == '\t') return -1;
+            size_t colon = http_find(line, (size_t)(line_end - line), ':');
+            if (colon == 0 || line + colon == line_end) return -1;
+            char *value = line + colon + 1;
+            while (*value == ' ' || *value == '\t') value++;
+            for (char *v = line_end; v > value && (v[-1] == ' ' || v[-1] == '\t'); v--) v[-1] = 0;
+            req->headers++;
+            if (colon == 4 && strncasecmp(line, "Host", 4) == 0) {
+                req->host = value;
+            } else if (colon == 19 && strncasecmp(line, "Proxy-Authorization", 19) == 0) {
+                req->proxy_authorization = value;
+            }
+        }
+    }
+    return 1;
+}
+
+#ifdef PAC_SERVER
+/*
+Proxy auto-config. With -p list (blacklist.txt: a domain per line, # starts a
+comment, a leading "*." or "." is ignored) GET /proxy.pac and GET /wpad.dat on
+the proxy port answer with a PAC script that sends the listed domains and
+their subdomains through this proxy and everything else direct. Domains under
+another listed domain are dropped, the rest become keys of one object, so the
+browser looks up each suffix of a host in a hash: a few lookups per request
+whatever the list size. The proxy address in the script is the Host the
+client asked for, or the local address of the connection. The list is checked
+on every request and compiled again when its mtime, size or inode changes;
+if it can't be read the previous script is served.
+*/
+static const char *pac_list = NULL;
+static pthread_mutex_t pac_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *pac_body = NULL; /* everything after the proxy line */
+static size_t pac_len = 0;
+static struct stat pac_stat;
+
+int pac_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* lowercased domain of a list line in place, NULL for empty or invalid lines */
+char *pac_domain(char *line) {
+    char *hash = strchr(line, '#');
+    if (hash) *hash = 0;
+    char *d = line;
+    while (isspace((unsigned char)*d)) d++;
+    char *end = d + strlen(d);
+    while (end > d && isspace((unsigned char)end[-1])) end--;
+    while (end > d && end[-1] == '.') end--;
+    *end = 0;
+    if (strncmp(d, "*.", 2) == 0) d += 2;
+    while (*d == '.') d++;
+    if (!*d) return NULL;
+    for (char *c = d; *c; c++) {
+        *c = (char)tolower((unsigned char)*c);
+        if (!isalnum((unsigned char)*c) && *c != '.' && *c != '-' && *c != '_') return NULL;
+    }
+    return d;
+}
+
+/* caller holds pac_lock */
+int pac_compile(void) {
+    FILE *f = fopen(pac_list, "r");
+    if (!f) {
+        LOG_ERRNO(LOG_WARNING, "pac: can't open %s", pac_list, 0, 0);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fileno(f), &st) < 0) st = (struct stat){0};
+    char **domains = NULL;
+    size_t count = 0, cap = 0, kept = 0, skipped = 0;
+    char line[512];
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = NULL;
+    int ret = -1;
+    while (fgets(line, sizeof(line), f)) {
+        char *d = pac_domain(line);
+        if (!d) {
+            skipped += line[strspn(line, " \t\r\n")] != 0;
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 256;
+            char **grown = realloc(domains, cap * sizeof(char *));
+            if (!grown) goto cleanup;
+            domains = grown;
+        }
+        if (!(domains[count] = strdup(d))) goto cleanup;
+        count++;
+    }
+    qsort(domains, count, sizeof(char *), pac_compare);
+    if (!(out = open_memstream(&body, &len))) goto cleanup;
+    fprintf(out, "var domains = {");
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && strcmp(domains[i], domains[i - 1]) == 0) continue;
+        int covered = 0;
+        for (const char *s = strchr(domains[i], '.'); s && !covered; s = strchr(s + 1, '.')) {
+            const char *suffix = s + 1;
+            covered = bsearch(&suffix, domains, count, sizeof(char *), pac_compare) != NULL;
+        }
+        if (covered) continue;
+        fprintf(out, "%s\n\"%s\": 1", kept++ ? "," : "", domains[i]);
+    }
+    fprintf(out, "\n};\n"
+                 "function FindProxyForURL(url, host) {\n"
+                 "    host = host.toLowerCase();\n"
+                 "    while (true) {\n"
+                 "        if (Object.prototype.hasOwnProperty.call(domains, host)) return proxy;\n"
+                 "        var dot = host.indexOf(\".\");\n"
+                 "        if (dot < 0) return \"DIRECT\";\n"
+                 "        host = host.substring(dot + 1);\n"
+                 "    }\n"
+                 "}\n");
+    if (fclose(out) != 0) {
+        out = NULL;
+        goto cleanup;
+    }
+    out = NULL;
+    free(pac_body);
+    pac_body = body;
+    pac_len = len;
+    body = NULL;
+    pac_stat = st;
+    LOG(LOG_INFO, "pac: %s compiled, %u domains, %u invalid lines skipped", pac_list, kept, skipped);
+    ret = 0;
+cleanup:
+    if (out) fclose(out);
+    free(body);
+    for (size_t i = 0; i < count; i++) free(domains[i]);
+    free(domains);
+    fclose(f);
+    return ret;
+}
+
+/* host header of the PAC request if it is a plain host[:port], else the local address */
+void pac_proxy(int fd, const char *host, char *proxy, size_t size) {
+    if (host && *host && strspn(host, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_:[]") == strlen(host) &&
+        strlen(host) < size) {
+        snprintf(proxy, size, "%s", host);
+        return;
+    }
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+    char ip[INET6_ADDRSTRLEN] = "127.0.0.1";
+    int port = 0;
+    if (getsockname(fd, (struct sockaddr *)&sa, &len) == 0 && sa.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&sa;
+        inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+        snprintf(proxy, size, "[%s]:%d", ip, ntohs(in6->sin6_port));
+        return;
+    }
+    if (sa.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&sa;
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        port = ntohs(in->sin_port);
+    }
+    snprintf(proxy, size, "%s:%d", ip, port);
+}
+
+void pac_write(int fd, const char *host) {
+    char proxy[300];
+    pac_proxy(fd, host, proxy, sizeof(proxy));
+    char head[512];
+    int head_len;
+    struct stat st;
+    pthread_mutex_lock(&pac_lock);
+    if (stat(pac_list, &st) == 0 && (st.st_mtim.tv_sec != pac_stat.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != pac_stat.st_mtim.tv_nsec || st.st_size != pac_stat.st_size || st.st_ino != pac_stat.st_ino)) {
+        pac_compile();
+    }
+    size_t len = pac_len;
+    char *body = pac_body ? malloc(len) : NULL;
+    if (body) memcpy(body, pac_body, len);
+    pthread_mutex_unlock(&pac_lock);
+    if (!body) {
+        head_len = snprintf(head, sizeof(head), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        write_n(fd, head, head_len);
+        return;
+    }
+    char line[400];
+    int line_len = snprintf(line, sizeof(line), "var proxy = \"PROXY %s; DIRECT\";\n", proxy);
+    head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/x-ns-proxy-autoconfig\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n", line_len + len);
+    if (write_n(fd, head, head_len) == head_len && write_n(fd, line, line_len) == line_len) write_n(fd, body, len);
+    free(body);
+}
+#endif
+
+#ifdef METRICS
+/*
+GET /metrics on the proxy port answers with counters in Prometheus text
+format: accepted connections, open tunnels and sections of compiled in features.
+*/
+void metrics_write(int fd) {
+    char *body = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&body, &len);
+    if (!out) return;
+    fprintf(out, "# TYPE proxy_accepted_total counter\nproxy_accepted_total %llu\n",
+            (unsigned long long)__atomic_load_n(&metrics_accepted, __ATOMIC_RELAXED));
+    fprintf(out, "# TYPE proxy_tunnels gauge\nproxy_tunnels %d\n", __atomic_load_n(&metrics_tunnels, __ATOMIC_RELAXED));
+#ifdef SOURCE_LIMITS
+    source_metrics(out);
+#endif
+#ifdef CIDR_RULES
+    rule_metrics(out);
+#endif
+#ifdef CIRCUIT_BREAKER
+    breaker_metrics(out);
+#endif
+#ifdef CPU_LOCAL
+    cpu_metrics(out);
+#endif
+#ifdef MUX_LINK
+    fprintf(out, "# TYPE proxy_mux_links gauge\nproxy_mux_links %d\n", __atomic_load_n(&metrics_mux_links, __ATOMIC_RELAXED));
+    fprintf(out, "# TYPE proxy_mux_streams gauge\nproxy_mux_streams %d\n", __atomic_load_n(&metrics_mux_streams, __ATOMIC_RELAXED));
+#endif
+    fclose(out);
+    char head[160];
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    if (write_n(fd, head, n) == n) write_n(fd, body, len);
+    free(body);
+}
+#endif
+
+void *handle_client(void *arg) {
+    client_t *client = (client_t *)arg;
+    int client_fd = client->fd;
+    char buffer[HTTP_REQUEST_MAX];
+    const char *host;
+    const char *port;
+    const uint8_t *early = NULL; /* pipelined after the request */
+    size_t early_len = 0;
+    int remote_fd;
+#ifdef UDP_RELAY
+    char socks_host[256];
+    char socks_port[8];
+#endif
+    /* accepted non-blocking: the request is normally there already (TCP_DEFER_ACCEPT), a silent client gets REQUEST_TIMEOUT_MS */
+    int64_t deadline = now_ns() + (int64_t)REQUEST_TIMEOUT_MS * 1000000;
+#ifdef CPU_LOCAL
+    int cpu = cpu_local_enter(client_fd);
+#endif
+    struct pollfd pfd = {client_fd, POLLIN, 0};
+    if (poll(&pfd, 1, REQUEST_TIMEOUT_MS) <= 0) goto cleanup;
+    ssize_t n = read(client_fd, buffer, sizeof(buffer));
+    if (n <= 0) goto cleanup;
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+#ifdef MUX_LINK
+    if (n >= MUX_PREFACE_LEN && memcmp(buffer, MUX_PREFACE, MUX_PREFACE_LEN) == 0) {
+#ifdef HOT_UPGRADE
+        __sync_sub_and_fetch(&handshakes, 1);
+#endif
+        mux_serve(client, (uint8_t *)buffer + MUX_PREFACE_LEN, n - MUX_PREFACE_LEN);
+        return NULL;
+    }
+#endif
+#ifdef UDP_RELAY
+    if (buffer[0] == SOCKS5_VERSION) {
+        int udp = 0;
+        host = socks_host;
+        remote_fd = socks5_request(client_fd, (uint8_t *)buffer, n, deadline, socks_host, sizeof(socks_host), socks_port, &udp,
+                                   &early, &early_len);
+        if (remote_fd < 0) goto cleanup;
+        if (udp) {
+#ifdef HOT_UPGRADE
+            __sync_sub_and_fetch(&handshakes, 1);
+#endif
+            udp_associate(client_fd, remote_fd, &client->addr);
+            close(remote_fd);
+            close(client_fd);
+#ifdef SOURCE_LIMITS
+            source_release(client->source);
+#endif
+            free(client);
+            return NULL;
+        }
+        port = socks_port;
+    } else
+#endif
+    {
+        http_request_t req = {0};
+        int parsed;
+        /* the request may come in pieces, all of it within REQUEST_TIMEOUT_MS */
+        while ((parsed = http_parse(&req, buffer, (size_t)n)) == 0) {
+            int64_t left_ms = (deadline - now_ns()) / 1000000;
+            if ((size_t)n == sizeof(buffer) || left_ms <= 0 || poll(&pfd, 1, (int)left_ms) <= 0) goto cleanup;
+            ssize_t got = read(client_fd, buffer + n, sizeof(buffer) - n);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) goto cleanup;
+            n += got;
+        }
+        if (parsed < 0) {
+            LOG(LOG_DEBUG, "malformed request", NULL, 0, 0);
+            goto cleanup;
+        }
+        early = (const uint8_t *)buffer + req.end;
+        early_len = (size_t)n - req.end;
+#ifdef METRICS
+        if (strcmp(req.method, "GET") == 0 && strcmp(req.target, "/metrics") == 0) {
+            metrics_write(client_fd);
+            goto cleanup;
+        }
+#endif
+#ifdef PAC_SERVER
+        if (pac_list && strcmp(req.method, "GET") == 0 &&
+            (strcmp(req.target, "/proxy.pac") == 0 || strcmp(req.target, "/wpad.dat") == 0)) {
+            pac_write(client_fd, req.host);
+            goto cleanup;
+        }
+#endif
+        if (strcmp(req.method, "CONNECT") != 0) goto cleanup;
+        /* authority form: host:port or [ipv6]:port, no length limit besides the buffer */
+        char *target = req.target;
+        char *colon = strrchr(target, ':');
+        if (!colon || colon == target || !colon[1]) goto cleanup;
+        *colon = 0;
+        port = colon + 1;
+        if (target[0] == '[' && colon[-1] == ']') {
+            colon[-1] = 0;
+            target++;
+        }
+        host = target;
+#ifdef MUX_LINK
+        if (mux_peer_host) {
+            if (mux_open(client_fd, host, port, client, early, early_len) < 0) goto cleanup;
+            free(client);
+#ifdef HOT_UPGRADE
+            __sync_sub_and_fetch(&handshakes, 1);
+#endif
+            return NULL;
+        }
+#endif
+        remote_fd = connect_remote(host, port);
+        if (remote_fd < 0) {
+#ifdef CIRCUIT_BREAKER
+            const char *fail = errno == ETIMEDOUT ? "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n" :
+                               "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+            write_n(client_fd, fail, strlen(fail));
+#endif
+            goto cleanup;
+        }
+        const char *resp = "HTTP/1.1 200 OK\r\n\r\n";
+        if (write_n(client_fd, resp, strlen(resp)) < 0) {
+            close(remote_fd);
+            goto cleanup;
+        }
+    }
+    tunnel_t *t = tunnel_open(client_fd, remote_fd, host, port, early, early_len);
+    if (!t) goto cleanup;
+#ifdef CPU_LOCAL
+    t->cpu = cpu;
+    if (cpu >= 0) __sync_add_and_fetch(&cpu_tunnels[cpu], 1);
+#endif
+#ifdef FAIR_SCHEDULER
+    t->addr = client->addr;
+#endif
+#ifdef SOURCE_LIMITS
+    t->source = client->source;
+#endif
+    tunnel_start(t);
+    free(client);
+#ifdef HOT_UPGRADE
+    __sync_sub_and_fetch(&handshakes, 1);
+#endif
+    return NULL;
+cleanup:
+    close(client_fd);
+#ifdef SOURCE_LIMITS
+    source_release(client->source);
+#endif
+    free(client);
+#ifdef HOT_UPGRADE
+    __sync_sub_and_fetch(&handshakes, 1);
+#endif
+    return NULL;
+}
+
+/*
+Listeners. Positional ip port is the first one, every -L adds another:
+ipv4:port, [ipv6]:port or unix:/path, optionally followed by @backlog.
+IPv6 listeners are v6 only, listen on 0.0.0.0 and [::] for dual stack.
+*/
+static int listen_fds[MAX_LISTENERS];
+static int listen_count = 0;
+static int listen_backlog = LISTEN_BACKLOG;
+#ifdef CPU_LOCAL
+static int listen_cpus[MAX_LISTENERS]; /* core of a -P socket, -1 - accepted by the main thread */
+#endif
+
+int listener_add(int listen_fd) {
+    if (listen_count == MAX_LISTENERS) {
+        LOG(LOG_ERR, "too many listeners (MAX_LISTENERS is %d)", NULL, MAX_LISTENERS, 0);
+        close(listen_fd);
+        return -1;
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+#ifdef CPU_LOCAL
+    listen_cpus[listen_count] = -1;
+#endif
+    listen_fds[listen_count++] = listen_fd;
+    return 0;
+}
+
+int create_unix_listener(const char *path, int backlog) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        LOG(LOG_ERR, "Unix socket path is too long: %s", path, 0, 0);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        LOG_ERRNO(LOG_ERR, "socket", NULL, 0, 0);
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path); /* stale socket of previous run, other files are left alone */
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOG_ERRNO(LOG_ERR, "bind %s", path, 0, 0);
+        close(listen_fd);
+        return -1;
+    }
+    if (listen(listen_fd, backlog) < 0) {
+        LOG_ERRNO(LOG_ERR, "listen", NULL, 0, 0);
+        close(listen_fd);
+        return -1;
+    }
+    LOG(LOG_INFO, "Proxy listening on unix:%s", path, 0, 0);
+    return listen_fd;
+}
+
+int create_listener(const char *ip, const char *port, int backlog) {
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    if (getaddrinfo(ip, port, &hints, &res) != 0) {
+        LOG(LOG_ERR, "Invalid listen address: %s", ip, 0, 0);
         return -1;
     }
-    for (rp = res; rp != NULL; rp = rp->ai_next) {
-        sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sock == -1) continue;
-        if (connect(sock, rp->ai_addr, rp->ai_addrlen) == 0) break;
-        close(sock);
-        sock = -1;
+    int listen_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (listen_fd < 0) {
+        LOG_ERRNO(LOG_ERR, "socket", NULL, 0, 0);
+        freeaddrinfo(res);
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef CPU_LOCAL
+    if (cpu_reuseport) {
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    }
+#endif
+    int defer = DEFER_ACCEPT_S;
+    if (defer > 0) {
+        setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+    }
+    if (res->ai_family == AF_INET6) {
+        setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+    }
+    if (bind(listen_fd, res->ai_addr, res->ai_addrlen) < 0) {
+        LOG_ERRNO(LOG_ERR, "bind %s", ip, 0, 0);
+        close(listen_fd);
+        freeaddrinfo(res);
+        return -1;
     }
     freeaddrinfo(res);
-    return sock;
+    if (listen(listen_fd, backlog) < 0) {
+        LOG_ERRNO(LOG_ERR, "listen", NULL, 0, 0);
+        close(listen_fd);
+        return -1;
+    }
+    LOG(LOG_INFO, "Proxy listening on %s port %d", ip, atoi(port), 0);
+    return listen_fd;
 }
 
-void *handle_client(void *arg) {
-    int client_fd = *(int *)arg;
-    free(arg);
-    char buffer[1500];
-    ssize_t n = read(client_fd, buffer, sizeof(buffer));
-    if (n <= 0) goto cleanup;
-    char *line_end = memchr(buffer, '\n', n);
-    if (!line_end) goto cleanup;
-    size_t line_len = line_end - buffer;
-    char line[1024];
-    if (line_len >= sizeof(line)) goto cleanup;
-    memcpy(line, buffer, line_len);
-    line[line_len] = 0;
-    char method[16], target[256];
-    if (sscanf(line, "%15s %255s", method, target) != 2) goto cleanup;
-    if (strcmp(method, "CONNECT") != 0) goto cleanup;
-    char *colon = strchr(target, ':');
-    if (!colon) goto cleanup;
+/* daemonize changes directory, relative unix: paths are resolved before */
+const char *listener_spec_absolute(const char *spec) {
+    if (strncmp(spec, "unix:", 5) != 0 || spec[5] == '/') return spec;
+    const char *path = absolute_path(spec + 5);
+    char *full = malloc(strlen(path) + 6);
+    if (!full) return spec;
+    sprintf(full, "unix:%s", path);
+    return full;
+}
+
+/* -L option value */
+int create_listener_spec(const char *spec) {
+    char buf[PATH_MAX];
+    int backlog = listen_backlog;
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *at = strrchr(buf, '@');
+    if (at) {
+        *at = 0;
+        backlog = atoi(at + 1);
+        if (backlog <= 0) return -1;
+    }
+    if (strncmp(buf, "unix:", 5) == 0) {
+        return create_unix_listener(buf + 5, backlog);
+    }
+    char *host = buf;
+    char *colon = strrchr(buf, ':');
+    if (!colon) return -1;
     *colon = 0;
-    const char *host = target;
-    const char *port = colon + 1;
-    int remote_fd = connect_remote(host, port);
-    if (remote_fd < 0) goto cleanup;
-    const char *resp = "HTTP/1.1 200 OK\r\n\r\n";
-    if (write_n(client_fd, resp, strlen(resp)) < 0) {
-        close(remote_fd);
-        goto cleanup;
+    if (host[0] == '[') {
+        host++;
+        size_t len = strlen(host);
+        if (len == 0 || host[len - 1] != ']') return -1;
+        host[len - 1] = 0;
     }
-    if (strcmp(port, "443") == 0) {
-        if (fragment_data(client_fd, remote_fd) < 0) {
-            close(remote_fd);
-            goto cleanup;
+    return create_listener(host, colon + 1, backlog);
+}
+
+#ifdef CPU_LOCAL
+/* the group picks socket number A, A is the CPU that received the SYN */
+int cpu_steer(int listen_fd) {
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        LOG_ERRNO(LOG_ERR, "SO_ATTACH_REUSEPORT_CBPF", NULL, 0, 0);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/* positional ip port or -L spec, with -P one socket per core for TCP */
+int listener_open(const char *spec, const char *ip, const char *port) {
+    int copies = 1;
+#ifdef CPU_LOCAL
+    if (cpu_reuseport && (!spec || strncmp(spec, "unix:", 5) != 0)) copies = cpu_count;
+#endif
+    for (int c = 0; c < copies; c++) {
+        int listen_fd = spec ? create_listener_spec(spec) : create_listener(ip, port, listen_backlog);
+        if (listen_fd < 0) {
+            if (spec) LOG(LOG_ERR, "Can't listen on %s", spec, 0, 0);
+            return -1;
         }
+#ifdef CPU_LOCAL
+        if (copies > 1 && c == 0 && cpu_steer(listen_fd) < 0) {
+            close(listen_fd);
+            return -1;
+        }
+#endif
+        if (listener_add(listen_fd) < 0) return -1;
+#ifdef CPU_LOCAL
+        if (copies > 1) listen_cpus[listen_count - 1] = c;
+#endif
     }
-    pthread_t t1, t2;
-    pipe_args_t *args1 = malloc(sizeof(pipe_args_t));
-    pipe_args_t *args2 = malloc(sizeof(pipe_args_t));
-    if (!args1 || !args2) {
-        close(remote_fd);
-        goto cleanup;
+    return 0;
+}
+
+#ifdef HOT_UPGRADE
+/*
+Hot upgrade. SIGUSR2 makes the process stop accepting, park every relay thread
+(SIGUSR1 interrupts blocking read/write, unsent bytes stay in the pipe buffer)
+and exec its binary again with -H fd. Over that unix socket the new process
+first checks the handoff header, then receives the listening socket and every
+tunnel (sockets via SCM_RIGHTS, unsent bytes inline) and confirms. The old
+process exits after confirmation and resumes its own tunnels otherwise.
+*/
+#define HANDOFF_MAGIC "PXHO"
+#define HANDOFF_VERSION 4
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t buffer_size; /* BUFFER_SIZE of the sender */
+    uint32_t features;    /* handoff_features() of the sender */
+    uint32_t listeners;
+    uint32_t tunnels;
+} handoff_header_t;
+
+typedef struct {
+    uint8_t done[2];
+    uint8_t reserved[2];
+    uint32_t pending[2];
+} handoff_tunnel_t;
+
+static int upgrade_pipe[2] = {-1, -1};
+static char self_path[PATH_MAX];
+static char **self_argv = NULL;
+
+/*
+Feature defines of the build. Tunnel layout and behaviour depend on them, so
+builds that differ in any of them (or in BUFFER_SIZE) can't take over each
+other. DEBUG, DAEMON and numeric tunables other than BUFFER_SIZE are not checked.
+*/
+uint32_t handoff_features(void) {
+    uint32_t features = 0;
+#ifdef ADAPTIVE_FRAGMENT
+    features |= 1u << 0;
+#endif
+#ifdef HELLO_CAPTURE
+    features |= 1u << 1;
+#endif
+#ifdef FAIR_SCHEDULER
+    features |= 1u << 2;
+#endif
+#ifdef SOCKET_PROFILES
+    features |= 1u << 3;
+#endif
+#ifdef UDP_RELAY
+    features |= 1u << 4;
+#endif
+#ifdef SOURCE_LIMITS
+    features |= 1u << 5;
+#endif
+#ifdef METRICS
+    features |= 1u << 6;
+#endif
+#ifdef MUX_LINK
+    features |= 1u << 7;
+#endif
+#ifdef WARM_CACHE
+    features |= 1u << 8;
+#endif
+#ifdef CPU_LOCAL
+    features |= 1u << 9;
+#endif
+#ifdef CIDR_RULES
+    features |= 1u << 10;
+#endif
+#ifdef PAC_SERVER
+    features |= 1u << 11;
+#endif
+#ifdef CIRCUIT_BREAKER
+    features |= 1u << 12;
+#endif
+    return features;
+}
+
+void on_upgrade_signal(int sig) {
+    (void)sig;
+    int saved = errno;
+    if (write(upgrade_pipe[1], "u", 1) < 0) {
+        /* pipe is full, upgrade is already requested */
+    }
+    errno = saved;
+}
+
+void on_wakeup_signal(int sig) {
+    (void)sig;
+}
+
+int send_fds(int sock, const int *fds, int nfds, const void *data, size_t len) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {(void *)data, len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    memset(control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+int recv_fds(int sock, int *fds, int nfds, void *data, size_t len) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {data, len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != (ssize_t)len || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(nfds * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    return 0;
+}
+
+int handoff_send(int sock) {
+    handoff_header_t hdr = {HANDOFF_MAGIC, HANDOFF_VERSION, BUFFER_SIZE, handoff_features(), listen_count, 0};
+    for (tunnel_t *t = tunnel_list; t; t = t->next) hdr.tunnels++;
+    char answer;
+    if (write_n(sock, &hdr, sizeof(hdr)) != sizeof(hdr)) return -1;
+    if (read_n(sock, &answer, 1) != 1 || answer != 'Y') return -1;
+    for (int i = 0; i < listen_count; i++) {
+        int32_t cpu = -1; /* -P socket keeps its core */
+#ifdef CPU_LOCAL
+        cpu = listen_cpus[i];
+#endif
+        if (send_fds(sock, &listen_fds[i], 1, &cpu, sizeof(cpu)) < 0) return -1;
+    }
+    for (tunnel_t *t = tunnel_list; t; t = t->next) {
+        handoff_tunnel_t rec = {{0}, {0}, {0}};
+        int fds[2] = {t->client_fd, t->remote_fd};
+        for (int d = 0; d < 2; d++) {
+            rec.done[d] = t->dirs[d].state == PIPE_DONE;
+            rec.pending[d] = (uint32_t)(t->dirs[d].pending - t->dirs[d].sent);
+        }
+        if (send_fds(sock, fds, 2, &rec, sizeof(rec)) < 0) return -1;
+        for (int d = 0; d < 2; d++) {
+            pipe_args_t *p = &t->dirs[d];
+            if (write_n(sock, p->buffer + p->sent, rec.pending[d]) != (ssize_t)rec.pending[d]) return -1;
+        }
+    }
+    if (read_n(sock, &answer, 1) != 1 || answer != 'Y') return -1;
+    return 0;
+}
+
+/* new process side, fills listen_fds */
+int handoff_receive(int sock) {
+    handoff_header_t hdr;
+    if (read_n(sock, &hdr, sizeof(hdr)) != sizeof(hdr)) return -1;
+    if (memcmp(hdr.magic, HANDOFF_MAGIC, 4) != 0 || hdr.version != HANDOFF_VERSION || hdr.buffer_size != BUFFER_SIZE ||
+        hdr.features != handoff_features()) {
+        LOG(LOG_WARNING, "handoff: incompatible build (version %u, features %x), refusing", NULL, hdr.version, hdr.features);
+        write_n(sock, "N", 1);
+        return -1;
+    }
+    if (write_n(sock, "Y", 1) != 1) return -1;
+    uint32_t count = hdr.tunnels;
+    for (uint32_t i = 0; i < hdr.listeners; i++) {
+        int listen_fd;
+        int32_t cpu;
+        if (recv_fds(sock, &listen_fd, 1, &cpu, sizeof(cpu)) < 0) return -1;
+        if (listener_add(listen_fd) < 0) return -1;
+#ifdef CPU_LOCAL
+        listen_cpus[listen_count - 1] = cpu < cpu_count ? cpu : -1;
+#endif
+    }
+    tunnel_t *received = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        handoff_tunnel_t rec;
+        int fds[2];
+        if (recv_fds(sock, fds, 2, &rec, sizeof(rec)) < 0) return -1;
+        tunnel_t *t = tunnel_new(fds[0], fds[1]);
+        if (!t) return -1;
+        for (int d = 0; d < 2; d++) {
+            pipe_args_t *p = &t->dirs[d];
+            if (rec.pending[d] > sizeof(p->buffer)) return -1;
+            if (read_n(sock, p->buffer, rec.pending[d]) != (ssize_t)rec.pending[d]) return -1;
+            p->pending = rec.pending[d];
+            if (rec.done[d]) {
+                p->state = PIPE_DONE;
+                t->refs--;
+            }
+        }
+#ifdef FAIR_SCHEDULER
+        socklen_t len = sizeof(t->addr);
+        getpeername(t->client_fd, (struct sockaddr *)&t->addr, &len);
+#endif
+#ifdef SOURCE_LIMITS
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getpeername(t->client_fd, (struct sockaddr *)&peer, &peer_len) == 0) t->source = source_track(&peer);
+#endif
+        t->next = received;
+        received = t;
+    }
+    if (write_n(sock, "Y", 1) != 1) return -1;
+    while (received) {
+        tunnel_t *t = received;
+        received = t->next;
+        tunnel_start(t);
+    }
+    LOG(LOG_INFO, "handoff: took over %u listening sockets and %u tunnels", NULL, hdr.listeners, count);
+    return 0;
+}
+
+/* returns only if the upgrade failed, tunnels are running again then */
+void hot_upgrade(void) {
+    upgrading = 1;
+    for (int i = 0; i < UPGRADE_WAIT_MS / 10 && __sync_add_and_fetch(&handshakes, 0) > 0; i++) {
+        usleep(10000);
+    }
+    pthread_mutex_lock(&tunnels_lock);
+    while (1) {
+        int running = 0;
+        for (tunnel_t *t = tunnel_list; t; t = t->next) {
+            for (int d = 0; d < 2; d++) {
+                if (t->dirs[d].state == PIPE_RUNNING) {
+                    running++;
+                    pthread_kill(t->dirs[d].thread, SIGUSR1);
+                }
+            }
+        }
+        if (!running) break;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&tunnels_cond, &tunnels_lock, &deadline);
+    }
+#ifdef ADAPTIVE_FRAGMENT
+    strategy_flush();
+#endif
+    int sv[2];
+    int ok = -1;
+    pid_t pid = -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+        char fd_arg[16];
+        int argc = 0;
+        while (self_argv[argc]) argc++;
+        char **args = calloc(argc + 3, sizeof(char *));
+        snprintf(fd_arg, sizeof(fd_arg), "%d", sv[1]);
+        long max_fd = sysconf(_SC_OPEN_MAX);
+        if (max_fd < 0 || max_fd > 65536) max_fd = 65536;
+        if (args) {
+            int j = 0;
+            args[j++] = self_path;
+            args[j++] = "-H";
+            args[j++] = fd_arg;
+            for (int i = 1; i < argc; i++) {
+                if (strcmp(self_argv[i], "-H") == 0 && i + 1 < argc) {
+                    i++;
+                    continue;
+                }
+                args[j++] = self_argv[i];
+            }
+            pid = fork();
+        }
+        if (pid == 0) {
+            for (int fd = 3; fd < max_fd; fd++) {
+                if (fd != sv[1]) close(fd);
+            }
+            execv(self_path, args);
+            _exit(127);
+        }
+        free(args);
+        close(sv[1]);
+        if (pid > 0) ok = handoff_send(sv[0]);
+        close(sv[0]);
+    }
+    if (ok == 0) {
+        LOG(LOG_INFO, "handoff: done, exiting", NULL, 0, 0);
+        usleep(2 * LOG_FLUSH_MS * 1000);
+        exit(0);
+    }
+    LOG(LOG_WARNING, "handoff: upgrade failed, resuming", NULL, 0, 0);
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    upgrading = 0;
+    tunnel_t *parked = tunnel_list;
+    tunnel_list = NULL;
+    pthread_mutex_unlock(&tunnels_lock);
+    while (parked) {
+        tunnel_t *t = parked;
+        parked = t->next;
+        tunnel_start(t);
+    }
+}
+#endif
+
+#ifndef HELLO_BENCH
+/*
+Accept. TCP listeners use TCP_DEFER_ACCEPT, so a connection shows up only
+when its request has arrived (or after DEFER_ACCEPT_S). Every wakeup drains up
+to ACCEPT_BATCH connections and queues them at once for handshake workers.
+A worker stays alive HANDSHAKE_IDLE_MS after its last client, new ones are
+started only for clients no idle worker will take.
+*/
+static client_t *accept_head = NULL;
+static client_t **accept_tail = &accept_head;
+static int accept_queued = 0;
+static int workers_idle = 0;
+static int workers_starting = 0;
+static pthread_mutex_t accept_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t accept_cond = PTHREAD_COND_INITIALIZER;
+
+void *handshake_worker(void *arg) {
+    (void)arg;
+#ifdef CPU_LOCAL
+    cpu_set_t affinity;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity) != 0) CPU_ZERO(&affinity);
+#endif
+    pthread_mutex_lock(&accept_lock);
+    workers_starting--;
+    while (1) {
+        while (!accept_head) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += HANDSHAKE_IDLE_MS / 1000;
+            deadline.tv_nsec += (HANDSHAKE_IDLE_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            workers_idle++;
+            int r = pthread_cond_timedwait(&accept_cond, &accept_lock, &deadline);
+            workers_idle--;
+            if (r == ETIMEDOUT && !accept_head) {
+                pthread_mutex_unlock(&accept_lock);
+                return NULL;
+            }
+        }
+        client_t *client = accept_head;
+        accept_head = client->next;
+        if (!accept_head) accept_tail = &accept_head;
+        accept_queued--;
+        pthread_mutex_unlock(&accept_lock);
+        handle_client(client);
+#ifdef CPU_LOCAL
+        if (CPU_COUNT(&affinity)) cpu_local_leave(&affinity);
+#endif
+        pthread_mutex_lock(&accept_lock);
+    }
+}
+
+void accept_clients(int listen_fd) {
+    client_t *batch = NULL;
+    client_t **tail = &batch;
+    int count = 0;
+    while (count < ACCEPT_BATCH) {
+        client_t *client = malloc(sizeof(client_t));
+        if (!client) {
+            LOG_ERRNO(LOG_ERR, "malloc", NULL, 0, 0);
+            break;
+        }
+        socklen_t client_len = sizeof(client->addr);
+        client->fd = accept4(listen_fd, (struct sockaddr *)&client->addr, &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client->fd < 0) {
+            int err = errno;
+            free(client);
+            if (err == EINTR || err == ECONNABORTED) continue;
+            if (err != EAGAIN && err != EWOULDBLOCK) {
+                errno = err;
+                LOG_ERRNO(LOG_ERR, "accept", NULL, 0, 0);
+            }
+            break;
+        }
+#ifdef METRICS
+        __atomic_add_fetch(&metrics_accepted, 1, __ATOMIC_RELAXED);
+#endif
+#ifdef SOURCE_LIMITS
+        if (!source_admit(&client->addr, &client->source)) {
+            close(client->fd);
+            free(client);
+            continue;
+        }
+#endif
+        client->next = NULL;
+        *tail = client;
+        tail = &client->next;
+        count++;
+    }
+    if (count == 0) return;
+#ifdef HOT_UPGRADE
+    __sync_add_and_fetch(&handshakes, count);
+#endif
+    pthread_mutex_lock(&accept_lock);
+    *accept_tail = batch;
+    accept_tail = tail;
+    accept_queued += count;
+    for (int spawn = accept_queued - workers_idle - workers_starting; spawn > 0; spawn--) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, handshake_worker, NULL) != 0) {
+            /* queued clients wait for running workers */
+            LOG_ERRNO(LOG_ERR, "pthread_create", NULL, 0, 0);
+            break;
+        }
+        pthread_detach(tid);
+        workers_starting++;
+    }
+    /* one wakeup per client, broadcast would wake every idle worker for each batch */
+    for (int i = 0; i < count; i++) pthread_cond_signal(&accept_cond);
+    pthread_mutex_unlock(&accept_lock);
+}
+
+#ifdef CPU_LOCAL
+/* accepts the -P sockets of one core, on that core */
+void *cpu_accept_thread(void *arg) {
+    int cpu = (int)(intptr_t)arg;
+    cpu_bind_thread(cpu);
+    struct pollfd pfds[MAX_LISTENERS];
+    int nfds = 0;
+    for (int i = 0; i < listen_count; i++) {
+        if (listen_cpus[i] != cpu) continue;
+        pfds[nfds].fd = listen_fds[i];
+        pfds[nfds++].events = POLLIN;
+    }
+    while (1) {
+#ifdef HOT_UPGRADE
+        if (upgrading) {
+            usleep(10000);
+            continue;
+        }
+#endif
+        if (poll(pfds, nfds, 100) <= 0) continue;
+        for (int i = 0; i < nfds; i++) {
+            if (pfds[i].revents & POLLIN) accept_clients(pfds[i].fd);
+        }
     }
-    args1->from_fd = client_fd;
-    args1->to_fd = remote_fd;
-    args2->from_fd = remote_fd;
-    args2->to_fd = client_fd;
-    pthread_create(&t1, NULL, pipe_data, args1);
-    pthread_create(&t2, NULL, pipe_data, args2);
-    pthread_detach(t1);
-    pthread_detach(t2);
-    return NULL;
-cleanup:
-    close(client_fd);
     return NULL;
 }
 
+void cpu_accept_start(void) {
+    for (int c = 0; c < cpu_count; c++) {
+        int used = 0;
+        for (int i = 0; i < listen_count; i++) used |= listen_cpus[i] == c;
+        if (!used) continue;
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, cpu_accept_thread, (void *)(intptr_t)c) != 0) {
+            LOG_ERRNO(LOG_ERR, "pthread_create", NULL, 0, 0);
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+}
+#endif
+
+static const char usage[] = "Usage: %s"
+    " [-v error|warning|info|debug] [-l stderr|syslog|file:path|ring:path:bytes]"
+    " [-L ipv4:port|[ipv6]:port|unix:path[@backlog]]... [-q backlog]"
+#ifdef ADAPTIVE_FRAGMENT
+    " [-s strategy_cache_file]"
+#endif
+#ifdef WARM_CACHE
+    " [-w warm_cache_file]"
+#endif
+#ifdef CIDR_RULES
+    " [-R rules_file]"
+#endif
+#ifdef PAC_SERVER
+    " [-p blacklist_file]"
+#endif
+#ifdef HELLO_CAPTURE
+    " [-c corpus_file [-a]]"
+#endif
+#ifdef FAIR_SCHEDULER
+    " [-b down_kbit[:up_kbit]] [-t tunnel_kbit] [-i client_ip_kbit]"
+#endif
+#ifdef UDP_RELAY
+    " [-Q]"
+#endif
+#ifdef SOURCE_LIMITS
+    " [-m connections_per_source] [-r new_connections_per_second_per_source]"
+#endif
+#ifdef MUX_LINK
+    " [-U peer_host:peer_port]"
+#endif
+#ifdef CPU_LOCAL
+    " [-C] [-P]"
+#endif
+    " [ip port]";
+
+static const char optstring[] = "v:l:L:q:"
+#ifdef ADAPTIVE_FRAGMENT
+    "s:"
+#endif
+#ifdef WARM_CACHE
+    "w:"
+#endif
+#ifdef CIDR_RULES
+    "R:"
+#endif
+#ifdef PAC_SERVER
+    "p:"
+#endif
+#ifdef HELLO_CAPTURE
+    "c:a"
+#endif
+#ifdef FAIR_SCHEDULER
+    "b:t:i:"
+#endif
+#ifdef UDP_RELAY
+    "Q"
+#endif
+#ifdef SOURCE_LIMITS
+    "m:r:"
+#endif
+#ifdef MUX_LINK
+    "U:"
+#endif
+#ifdef CPU_LOCAL
+    "CP"
+#endif
+#ifdef HOT_UPGRADE
+    "H:"
+#endif
+    ;
+
 int main(int argc, char *argv[]) {
-    if(argc != 3) {
-#ifdef DEBUG
-        fprintf(stderr, "Usage: %s ip port\n", argv[0]);
+    int c;
+    const char *listen_specs[MAX_LISTENERS];
+    int listen_spec_count = 0;
+#ifdef HOT_UPGRADE
+    int handoff_fd = -1;
+    self_argv = calloc(argc + 1, sizeof(char *));
+    if (!self_argv) return -1;
+    memcpy(self_argv, argv, argc * sizeof(char *));
+    if (!strchr(argv[0], '/') || !realpath(argv[0], self_path)) {
+        snprintf(self_path, sizeof(self_path), "/proc/self/exe");
+    }
+#endif
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+        switch (c) {
+        case 'v':
+            if ((log_level = log_parse_level(optarg)) < 0) goto bad_usage;
+            break;
+        case 'l':
+            if (log_parse_sink(optarg) < 0) goto bad_usage;
+            break;
+        case 'L':
+            if (listen_spec_count == MAX_LISTENERS) goto bad_usage;
+            listen_specs[listen_spec_count++] = optarg;
+            break;
+        case 'q':
+            if ((listen_backlog = atoi(optarg)) <= 0) goto bad_usage;
+            break;
+#ifdef ADAPTIVE_FRAGMENT
+        case 's':
+            strategy_cache_file = optarg;
+            break;
+#endif
+#ifdef WARM_CACHE
+        case 'w':
+            warm_file = optarg;
+            break;
+#endif
+#ifdef CIDR_RULES
+        case 'R':
+            rules_file = optarg;
+            break;
+#endif
+#ifdef PAC_SERVER
+        case 'p':
+            pac_list = optarg;
+            break;
+#endif
+#ifdef HELLO_CAPTURE
+        case 'c':
+            capture_file = fopen(optarg, "ab");
+            if (!capture_file) {
+                LOG_ERRNO(LOG_ERR, "capture: can't open %s", optarg, 0, 0);
+                return -1;
+            }
+            break;
+        case 'a':
+            capture_anonymize = 1;
+            break;
+#endif
+#ifdef UDP_RELAY
+        case 'Q':
+            quic_reorder = 1;
+            break;
+#endif
+#ifdef SOURCE_LIMITS
+        case 'm':
+            if ((source_max_active = atoi(optarg)) <= 0) goto bad_usage;
+            break;
+        case 'r':
+            if ((source_rate = atoi(optarg)) <= 0) goto bad_usage;
+            break;
+#endif
+#ifdef MUX_LINK
+        case 'U':
+            if (mux_parse_peer(optarg) < 0) goto bad_usage;
+            break;
+#endif
+#ifdef CPU_LOCAL
+        case 'C':
+            cpu_pin = 1;
+            break;
+        case 'P':
+            cpu_reuseport = 1;
+            break;
+#endif
+#ifdef FAIR_SCHEDULER
+        case 'b': {
+            char *up = strchr(optarg, ':');
+            sched_link_rate[SCHED_DOWN] = parse_kbit(optarg);
+            sched_link_rate[SCHED_UP] = up ? parse_kbit(up + 1) : 0;
+            if (sched_link_rate[SCHED_DOWN] < 0 || sched_link_rate[SCHED_UP] < 0) goto bad_usage;
+            break;
+        }
+        case 't':
+            if ((sched_tunnel_rate = parse_kbit(optarg)) < 0) goto bad_usage;
+            break;
+        case 'i':
+            if ((sched_ip_rate = parse_kbit(optarg)) < 0) goto bad_usage;
+            break;
+#endif
+#ifdef HOT_UPGRADE
+        case 'H':
+            handoff_fd = atoi(optarg);
+            break;
 #endif
+        default:
+            goto bad_usage;
+        }
+    }
+    if (argc - optind != 2 && (argc != optind || listen_spec_count == 0)) {
+bad_usage:
+        LOG(LOG_ERR, usage, argv[0], 0, 0);
         return -1;
     }
-    char* LISTEN_IP = argv[1];
+    char* LISTEN_IP = argc > optind ? argv[optind] : NULL;
     uint16_t LISTEN_PORT;
-    if(sscanf(argv[2], "%hu", &LISTEN_PORT) != 1) {
-#ifdef DEBUG
-        fprintf(stderr, "Invalid port: %s\n", argv[2]);
-#endif
+    if(LISTEN_IP && sscanf(argv[optind + 1], "%hu", &LISTEN_PORT) != 1) {
+        LOG(LOG_ERR, "Invalid port: %s", argv[optind + 1], 0, 0);
         return -1;
     }
-#ifdef DAEMON
-    daemonize();
+#ifdef ADAPTIVE_FRAGMENT
+    if (strategy_cache_file) {
+        strategy_cache_file = absolute_path(strategy_cache_file);
+        strategy_load();
+    }
 #endif
-    signal(SIGPIPE, SIG_IGN);
-    srand(time(NULL));
-    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-#ifdef DEBUG
-        perror("socket");
+#ifdef WARM_CACHE
+    if (warm_file) {
+        warm_file = absolute_path(warm_file);
+        warm_open();
+    }
 #endif
-        exit(1);
+#ifdef CIDR_RULES
+    if (rules_file && rules_load() < 0) exit(1);
+#endif
+#ifdef PAC_SERVER
+    if (pac_list) {
+        pac_list = absolute_path(pac_list);
+        if (pac_compile() < 0) exit(1);
     }
-    int opt = 1;
-    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(LISTEN_PORT);
-    if (inet_pton(AF_INET, LISTEN_IP, &addr.sin_addr) != 1) {
-#ifdef DEBUG
-        fprintf(stderr, "Invalid listen IP address: %s\n", LISTEN_IP);
 #endif
-        exit(1);
+#ifdef FAIR_SCHEDULER
+    sched_init();
+#endif
+#ifdef SOCKET_PROFILES
+    profile_init();
+#endif
+    if (log_path) {
+        log_path = absolute_path(log_path);
     }
-    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-#ifdef DEBUG
-        perror("bind");
+    for (int i = 0; i < listen_spec_count; i++) {
+        listen_specs[i] = listener_spec_absolute(listen_specs[i]);
+    }
+#ifdef DAEMON
+#ifdef HOT_UPGRADE
+    if (handoff_fd < 0)
 #endif
-        close(listen_fd);
-        exit(1);
+    daemonize();
+#endif
+    log_start();
+    signal(SIGPIPE, SIG_IGN);
+#ifdef CPU_LOCAL
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    cpu_count = cpus < 1 ? 1 : cpus > CPU_LOCAL_MAX ? CPU_LOCAL_MAX : (int)cpus;
+#endif
+    srand(time(NULL));
+#ifdef HOT_UPGRADE
+    struct sigaction sa = {0};
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = on_wakeup_signal; /* no SA_RESTART, interrupts relay threads */
+    sigaction(SIGUSR1, &sa, NULL);
+    if (pipe(upgrade_pipe) == 0) {
+        fcntl(upgrade_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(upgrade_pipe[1], F_SETFL, O_NONBLOCK);
+        sa.sa_handler = on_upgrade_signal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &sa, NULL);
     }
-    if (listen(listen_fd, 128) < 0) {
-#ifdef DEBUG
-        perror("listen");
+    if (handoff_fd >= 0) {
+        int ok = handoff_receive(handoff_fd);
+        close(handoff_fd);
+        if (ok < 0) exit(1);
+    } else
 #endif
-        close(listen_fd);
-        exit(1);
+    {
+        if (LISTEN_IP && listener_open(NULL, LISTEN_IP, argv[optind + 1]) < 0) exit(1);
+        for (int i = 0; i < listen_spec_count; i++) {
+            if (listener_open(listen_specs[i], NULL, NULL) < 0) exit(1);
+        }
     }
-#ifdef DEBUG
-    printf("Proxy listening on %s:%d\n", LISTEN_IP, LISTEN_PORT);
+#ifdef CPU_LOCAL
+    cpu_accept_start();
 #endif
+    struct pollfd pfds[MAX_LISTENERS + 1];
     while (1) {
-        struct sockaddr_storage client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int *client_fd = malloc(sizeof(int));
-        if (!client_fd) {
-#ifdef DEBUG
-            perror("malloc");
+        int nfds = 0;
+        for (int i = 0; i < listen_count; i++) {
+#ifdef CPU_LOCAL
+            pfds[nfds].fd = listen_cpus[i] < 0 ? listen_fds[i] : -1; /* poll skips negative fds */
+#else
+            pfds[nfds].fd = listen_fds[i];
 #endif
-            continue;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds++].revents = 0;
         }
-        *client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
-        if (*client_fd < 0) {
-#ifdef DEBUG
-            perror("accept");
+#ifdef HOT_UPGRADE
+        pfds[nfds].fd = upgrade_pipe[0];
+        pfds[nfds].events = POLLIN;
+        pfds[nfds++].revents = 0;
 #endif
-            free(client_fd);
+        if (poll(pfds, nfds, -1) < 0) continue;
+#ifdef HOT_UPGRADE
+        if (pfds[nfds - 1].revents) {
+            char drain[16];
+            while (read(upgrade_pipe[0], drain, sizeof(drain)) > 0);
+            hot_upgrade();
             continue;
         }
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, client_fd) != 0) {
-#ifdef DEBUG
-            perror("pthread_create");
 #endif
-            close(*client_fd);
-            free(client_fd);
-            continue;
+        for (int i = 0; i < listen_count; i++) {
+            if (pfds[i].revents & POLLIN) accept_clients(listen_fds[i]);
         }
-        pthread_detach(tid);
     }
-    close(listen_fd);
     return 0;
 }
+#endif
@@ -0,0 +1,125 @@
+/*
+ClientHello replay benchmark for the fragmentation code of c_linux_pthread.c.
+Reads a corpus captured with -DHELLO_CAPTURE (-c file option), runs every hello
+through SNI search and every fragmentation strategy, checks that reassembly of
+the output gives back the original bytes and reports speed and output size
+(hellos without SNI are only counted). Exit code is 1 if any hello fails the
+check, so it can be used as regression gate.
+
+Compilation:
+gcc -Wall -Wextra -O2 hello_bench.c -o hello_bench -lpthread
+
+Usage:
+./hello_bench corpus_file [iterations]
+*/
+
+#define HELLO_BENCH
+#include "c_linux_pthread.c"
+
+typedef struct {
+    uint8_t *bytes;
+    size_t len;
+} hello_t;
+
+int load_corpus(const char *path, hello_t **hellos, size_t *count) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    size_t cap = 0;
+    *count = 0;
+    *hellos = NULL;
+    uint32_t len_be;
+    while (fread(&len_be, 4, 1, f) == 1) {
+        size_t len = ntohl(len_be);
+        if (len < 5 || len > 5 + 2048) break;
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 64;
+            hello_t *grown = realloc(*hellos, cap * sizeof(hello_t));
+            if (!grown) break;
+            *hellos = grown;
+        }
+        hello_t *h = &(*hellos)[*count];
+        h->bytes = malloc(len);
+        if (!h->bytes || fread(h->bytes, len, 1, f) != 1) {
+            free(h->bytes);
+            break;
+        }
+        h->len = len;
+        (*count)++;
+    }
+    fclose(f);
+    return 0;
+}
+
+/* records strategies must give back the record body, the others the whole record */
+int reassembles(const frag_out_t *out, frag_strategy_t strategy, const hello_t *h, int *records) {
+    uint8_t joined[FRAG_OUT_SIZE];
+    size_t joined_len = 0;
+    *records = 0;
+    if (strategy == FRAG_NONE || strategy == FRAG_TCP_SPLIT) {
+        *records = 1;
+        return out->len == h->len && memcmp(out->buf, h->bytes, h->len) == 0;
+    }
+    for (size_t pos = 0; pos < out->len; (*records)++) {
+        if (pos + 5 > out->len || out->buf[pos] != 0x16) return 0;
+        size_t len = ((size_t)out->buf[pos + 3] << 8) | out->buf[pos + 4];
+        if (len == 0 || pos + 5 + len > out->len) return 0;
+        memcpy(joined + joined_len, out->buf + pos + 5, len);
+        joined_len += len;
+        pos += 5 + len;
+    }
+    return joined_len == h->len - 5 && memcmp(joined, h->bytes + 5, joined_len) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s corpus_file [iterations]\n", argv[0]);
+        return 2;
+    }
+    long iterations = argc == 3 ? atol(argv[2]) : 20000;
+    hello_t *hellos;
+    size_t count;
+    if (load_corpus(argv[1], &hellos, &count) < 0 || count == 0) {
+        fprintf(stderr, "Can't load corpus %s\n", argv[1]);
+        return 2;
+    }
+    printf("%zu hellos, %ld iterations\n", count, iterations);
+    printf("%-14s %12s %14s %14s %14s %8s %8s\n", "strategy", "hellos/s", "bytes/hello", "records/hello", "writes/hello", "no_sni", "failed");
+    static frag_out_t out;
+    int failed_total = 0;
+    for (int s = 0; s < FRAG_STRATEGY_COUNT; s++) {
+        int failed = 0;
+        int no_sni = 0;
+        size_t bytes = 0;
+        size_t records = 0;
+        size_t writes = 0;
+        for (size_t i = 0; i < count; i++) {
+            int r = 0;
+            if (frag_build(&out, (frag_strategy_t)s, hellos[i].bytes, hellos[i].bytes + 5, hellos[i].len - 5) < 0) {
+                no_sni++;
+                continue;
+            }
+            if (!reassembles(&out, (frag_strategy_t)s, &hellos[i], &r)) {
+                failed++;
+                continue;
+            }
+            bytes += out.len;
+            records += r;
+            writes += out.segments;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long it = 0; it < iterations; it++) {
+            for (size_t i = 0; i < count; i++) {
+                frag_build(&out, (frag_strategy_t)s, hellos[i].bytes, hellos[i].bytes + 5, hellos[i].len - 5);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        size_t ok = count - failed - no_sni;
+        printf("%-14s %12.0f %14.1f %14.2f %14.2f %8d %8d\n", frag_strategy_names[s],
+               seconds > 0 ? iterations * count / seconds : 0.0,
+               ok ? (double)bytes / ok : 0.0, ok ? (double)records / ok : 0.0, ok ? (double)writes / ok : 0.0, no_sni, failed);
+        failed_total += failed;
+    }
+    return failed_total ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+/*
+Connection storm benchmark for a running proxy. Client threads open
+connections as fast as they can, send CONNECT to a local target that accepts
+and closes, wait for the proxy answer and close. Idle connections that never
+send anything can be kept open meanwhile, like half-open or slow clients.
+Reports handshakes per second and latency percentiles.
+
+Compilation:
+gcc -Wall -Wextra -O2 storm_bench.c -o storm_bench -lpthread
+
+Usage:
+./storm_bench proxy_ip proxy_port [seconds] [clients] [idle_connections]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+
+#define MAX_SAMPLES 1000000
+#define TARGET_THREADS 8 /* target must keep up with the proxy, or its backlog is measured */
+
+static struct sockaddr_in proxy_addr;
+static uint16_t target_port;
+static volatile int running = 1;
+static pthread_mutex_t samples_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t *samples;
+static size_t sample_count = 0;
+static uint64_t failed = 0;
+
+int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* target the proxy connects to: accepts and closes */
+void *target_thread(void *arg) {
+    int listen_fd = *(int *)arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0) close(fd);
+    }
+    return NULL;
+}
+
+int connect_proxy(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct linger lg = {1, 0}; /* reset instead of TIME_WAIT, storm would run out of ports */
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    if (connect(fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void *client_thread(void *arg) {
+    (void)arg;
+    char request[64];
+    int len = snprintf(request, sizeof(request), "CONNECT 127.0.0.1:%u HTTP/1.1\r\n\r\n", target_port);
+    while (running) {
+        int64_t start = now_us();
+        int fd = connect_proxy();
+        int ok = 0;
+        if (fd >= 0) {
+            char reply[64];
+            ok = write(fd, request, len) == len && read(fd, reply, sizeof(reply)) > 0 && memcmp(reply, "HTTP/1.1 200", 12) == 0;
+            close(fd);
+        }
+        int64_t elapsed = now_us() - start;
+        pthread_mutex_lock(&samples_lock);
+        if (!ok) failed++;
+        else if (sample_count < MAX_SAMPLES) samples[sample_count++] = elapsed;
+        pthread_mutex_unlock(&samples_lock);
+    }
+    return NULL;
+}
+
+int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 6) {
+        fprintf(stderr, "Usage: %s proxy_ip proxy_port [seconds] [clients] [idle_connections]\n", argv[0]);
+        return 2;
+    }
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    int clients = argc > 4 ? atoi(argv[4]) : 64;
+    int idle = argc > 5 ? atoi(argv[5]) : 0;
+    signal(SIGPIPE, SIG_IGN);
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_port = htons((uint16_t)atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &proxy_addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid proxy ip %s\n", argv[1]);
+        return 2;
+    }
+    samples = malloc(MAX_SAMPLES * sizeof(int64_t));
+    if (!samples) return 2;
+
+    int target_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in target = {0};
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t target_len = sizeof(target);
+    if (target_fd < 0 || bind(target_fd, (struct sockaddr *)&target, sizeof(target)) < 0 || listen(target_fd, 4096) < 0 ||
+        getsockname(target_fd, (struct sockaddr *)&target, &target_len) < 0) {
+        perror("target");
+        return 2;
+    }
+    target_port = ntohs(target.sin_port);
+    for (int i = 0; i < TARGET_THREADS; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, target_thread, &target_fd);
+    }
+
+    int idle_open = 0;
+    for (int i = 0; i < idle; i++) {
+        if (connect_proxy() >= 0) idle_open++;
+    }
+
+    pthread_t *threads = malloc(clients * sizeof(pthread_t));
+    if (!threads) return 2;
+    int64_t start = now_us();
+    for (int i = 0; i < clients; i++) pthread_create(&threads[i], NULL, client_thread, NULL);
+    sleep(seconds);
+    running = 0;
+    for (int i = 0; i < clients; i++) pthread_join(threads[i], NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    qsort(samples, sample_count, sizeof(int64_t), compare_int64);
+    printf("%d clients, %d idle connections, %.1f s\n", clients, idle_open, elapsed);
+    printf("%12s %10s %10s %10s %10s\n", "handshakes/s", "failed", "p50_us", "p99_us", "max_us");
+    printf("%12.0f %10llu %10lld %10lld %10lld\n", sample_count / elapsed, (unsigned long long)failed,
+           sample_count ? (long long)samples[sample_count / 2] : 0LL,
+           sample_count ? (long long)samples[sample_count * 99 / 100] : 0LL,
+           sample_count ? (long long)samples[sample_count - 1] : 0LL);
+    return failed > sample_count / 100 ? 1 : 0;
+}